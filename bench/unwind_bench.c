@@ -0,0 +1,91 @@
+/*
+ * Created 191023 lynnl
+ *
+ * Benchmark stack unwinders: frames per microsecond for 16, 32 and 64-deep stacks
+ * Build with -fno-omit-frame-pointer, otherwise frame pointer unwinder stops early
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/utils.h"
+#include "../src/unwind.h"
+
+#define LOG(fmt, ...)       (void) printf(fmt "\n", ##__VA_ARGS__)
+
+#define BENCH_MAX_DEPTH     64
+#define BENCH_ITERATIONS    20000
+
+typedef struct {
+    unwind_fn fn;
+    uint32_t depth;
+    uint64_t frames;
+    uint64_t ns;
+} bench_t;
+
+static void bench_run(bench_t *b)
+{
+    void *pcs[BENCH_MAX_DEPTH];
+    uint64_t t;
+    int i;
+
+    /* Warm up(e.g. glibc loads libgcc_s upon first backtrace(3)) */
+    (void) b->fn(pcs, b->depth);
+
+    t = monotonic_ns();
+    for (i = 0; i < BENCH_ITERATIONS; i++) {
+        b->frames += b->fn(pcs, b->depth);
+    }
+    b->ns = monotonic_ns() - t;
+}
+
+/* Recurse until we have `depth' frames below, then run the benchmark */
+__attribute__((noinline))
+static int recurse(bench_t *b, uint32_t n)
+{
+    volatile int r;     /* Defeat tail call optimization */
+
+    if (n >= b->depth) {
+        bench_run(b);
+        return 0;
+    }
+
+    r = recurse(b, n + 1);
+    return r;
+}
+
+int main(void)
+{
+    static const uint32_t depths[] = {16, 32, 64};
+    bench_t b;
+    unwind_fn fn;
+    unwinder_t u;
+    size_t i;
+
+    LOG("%-12s %6s %14s %14s %12s", "unwinder", "depth", "frames/call", "ns/call", "frames/us");
+
+    for (u = 0; u < UNWINDER_MAX; u++) {
+        fn = unwinder_get(u);
+        if (fn == NULL) {
+            LOG("%-12s (not available in this build)", unwinder_name(u));
+            continue;
+        }
+
+        for (i = 0; i < ARRAY_SIZE(depths); i++) {
+            b.fn = fn;
+            b.depth = depths[i];
+            b.frames = 0;
+            b.ns = 0;
+
+            (void) recurse(&b, 0);
+
+            LOG("%-12s %6u %14.1f %14.1f %12.2f",
+                unwinder_name(u), depths[i],
+                (double) b.frames / BENCH_ITERATIONS,
+                (double) b.ns / BENCH_ITERATIONS,
+                b.ns != 0 ? b.frames * 1000.0 / b.ns : 0.0);
+        }
+    }
+
+    return 0;
+}
@@ -7,6 +7,8 @@
 #ifndef __CSENTRY_H__
 #define __CSENTRY_H__
 
+#include <stdint.h>
+#include <stddef.h>
 #include <cjson/cJSON.h>
 #include <uuid/uuid.h>
 
@@ -17,8 +19,42 @@
 #define CSENTRY_NAME                "cSentry"
 #define CSENTRY_VERSION             "0.1"
 
+/* DSNs of a client at most, see csentry_new() */
+#define CSENTRY_DSN_MAX             4
+
+/* Attachments of a client at most, see csentry_add_attachment() */
+#define CSENTRY_ATTACHMENTS_MAX     4
+/* Bytes of an attachment at most, only the tail of a larger file is sent */
+#define CSENTRY_ATTACHMENT_SIZE_MAX (1u << 20u)
+
 /* Enclose backtrace into message capture */
 #define CSENTRY_CAPTURE_ENCLOSE_BT  0x1u
+/* Also enclose stacks of all other threads(Linux), implies CSENTRY_CAPTURE_ENCLOSE_BT */
+#define CSENTRY_CAPTURE_ALL_THREADS 0x2u
+
+/*
+ * Flags of csentry_new()
+ * Unwinder defaults to backtrace(3) if none specified
+ */
+#define CSENTRY_INIT_INSTALL_HANDLERS   0x1u
+#define CSENTRY_INIT_CRASH_HELPER       0x2u    /* Out-of-process crash handling(Linux) */
+#define CSENTRY_INIT_CAPTURE_THREADS    0x4u    /* csentry_capture_exception() with all threads */
+/*
+ * Multi-process mode: events are handed to a shared-memory ring of the DSN
+ *  only one process(the uploader) runs the worker and POSTs them
+ * A producer creates neither worker thread nor connection
+ */
+#define CSENTRY_INIT_SHARED_RING        0x8u
+#define CSENTRY_INIT_RING_UPLOADER      0x10u   /* Implies CSENTRY_INIT_SHARED_RING, standby if taken */
+/* Ship events to a local relay(env CSENTRY_RELAY_SOCKET) instead of Sentry server */
+#define CSENTRY_INIT_RELAY              0x20u
+/* Fire-and-forget UDP datagrams(env CSENTRY_UDP_ADDR), lossy but never blocks */
+#define CSENTRY_INIT_UDP                0x40u
+/* Warm up DNS, connection and TLS session in background, so the first event doesn't pay for them */
+#define CSENTRY_INIT_PRECONNECT         0x80u
+#define CSENTRY_INIT_UNWIND_FP          0x100u  /* Needs -fno-omit-frame-pointer builds */
+#define CSENTRY_INIT_UNWIND_LIBUNWIND   0x200u  /* Needs CSENTRY_WITH_LIBUNWIND builds */
+#define CSENTRY_INIT_UNWIND_MASK        0x300u
 
 /*
  * Most significant 3 bits denoted log level
@@ -29,19 +65,58 @@
 #define CSENTRY_LEVEL_INFO          0x40000000u
 #define CSENTRY_LEVEL_WARN          0x60000000u
 #define CSENTRY_LEVEL_FATAL         0x80000000u
+#define CSENTRY_LEVEL_MASK          0xe0000000u
 
 #define CSENTRY_BC_TYPE_DEFAULT     0x00000000u     /* Unnecessary */
 #define CSENTRY_BC_TYPE_HTTP        0x08000000u
 #define CSENTRY_BC_TYPE_ERROR       0x10000000u
 
+/*
+ * Latency histogram, bucket i counts samples <= 2^i microseconds
+ *  the last bucket counts the rest(+Inf)
+ */
+#define CSENTRY_STATS_BUCKETS       24
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t buckets[CSENTRY_STATS_BUCKETS];    /* Non-cumulative */
+} csentry_histogram_t;
+
+typedef struct {
+    uint64_t captured;          /* Events queued for POST */
+    uint64_t sampled_out;
+    uint64_t disabled_dropped;
+    uint64_t rate_limited;
+    uint64_t coalesced;         /* Occurrences merged into a queued event */
+    uint64_t queue_dropped;     /* Queue full(or ENOMEM) */
+    uint64_t oversized_dropped; /* Exceeded UDP datagram size */
+    uint64_t sent;              /* Accepted by Sentry server */
+    uint64_t failed;
+    uint64_t retried;           /* Spooled events sent again */
+    uint64_t bytes_sent;
+    uint64_t http_inflight_bytes;   /* Gauge, request bodies in flight */
+
+    csentry_histogram_t capture_latency;    /* Capture call to queued */
+    csentry_histogram_t serialize_latency;
+    csentry_histogram_t http_latency;       /* HTTP round-trip */
+} csentry_stats_t;
+
 void * _nullable csentry_new(const char *, const cJSON * _nullable, float, int);
 void csentry_destroy(void *);
 void csentry_debug(void *);
 
-void csentry_capture_message(void *, uint32_t, const char *, ...);
-void csentry_capture_exception(void *, const char *, ...);
+/* Return event id(thread-local), NULL if the event dropped */
+const char * _nullable csentry_capture_message(void *, uint32_t, const char *, ...);
+const char * _nullable csentry_capture_message_keyed(void *, const char *, uint32_t, const char *, ...);
+const char * _nullable csentry_capture_message_logger(void *, const char *, uint32_t, const char *, ...);
+const char * _nullable csentry_capture_exception(void *, const char *, ...);
 void csentry_add_breadcrumb(void *, const cJSON * _nullable, uint32_t, const char *, ...);
 
+int csentry_add_attachment(void *, const char *, const char * _nullable);
+int csentry_add_attachment_fd(void *, int, const char *, const char * _nullable);
+void csentry_clear_attachments(void *);
+
 void csentry_get_last_event_id(void *, uuid_t);
 void csentry_get_last_event_id_string(void *, uuid_string_t);
 
@@ -53,6 +128,16 @@ int csentry_ctx_update(void *, const cJSON * _nullable);
 void csentry_ctx_clear(void *);
 
 void csentry_set_enable(void *, int);
+int csentry_set_sample_rate(void *, uint32_t, float);
+int csentry_set_logger_sample_rate(void *, const char *, float);
+int csentry_set_rate_limit(void *, float, uint32_t);
+void csentry_set_coalesce_window(void *, uint32_t);
+void csentry_set_exception_deadline(void *, uint32_t);
+int csentry_set_http_concurrency(void *, uint32_t, size_t);
+void csentry_set_http_timeouts(void *, uint32_t, uint32_t);
+
+void csentry_get_stats(void *, csentry_stats_t *);
+int csentry_stats_export(void *, const char *);
 
 #endif /* __CSENTRY_H__ */
 
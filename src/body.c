@@ -0,0 +1,147 @@
+/*
+ * Created 191102 lynnl
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "body.h"
+
+void body_init(body_t *body)
+{
+    assert_nonnull(body);
+    body->n = 0;
+    body->size = 0;
+}
+
+static int body_add_seg(body_t *body, const char * _nullable data, int fd, off_t off, size_t size)
+{
+    body_seg_t *seg;
+
+    if (size == 0) return 0;
+
+    if (body->n == BODY_SEGS_MAX) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    seg = &body->segs[body->n++];
+    seg->data = data;
+    seg->fd = fd;
+    seg->off = off;
+    seg->size = size;
+    body->size += size;
+
+    return 0;
+}
+
+/**
+ * Append a segment, empty ones are skipped
+ * @data        Borrowed, must be kept valid until requests are done
+ * @return      0 if success  -1 o.w.(errno will be set)
+ */
+int body_add(body_t *body, const char *data, size_t size)
+{
+    assert_nonnull(body);
+    assert_nonnull(data);
+    return body_add_seg(body, data, -1, 0, size);
+}
+
+/**
+ * Append `size' bytes of a file at `off', read upon streaming
+ * @fd          Borrowed, file position is left untouched
+ * @return      0 if success  -1 o.w.(errno will be set)
+ */
+int body_add_fd(body_t *body, int fd, off_t off, size_t size)
+{
+    assert_nonnull(body);
+    assert(fd >= 0);
+    return body_add_seg(body, NULL, fd, off, size);
+}
+
+size_t body_size(const body_t *body)
+{
+    assert_nonnull(body);
+    return body->size;
+}
+
+void body_cursor_init(body_cursor_t *cur, const body_t *body)
+{
+    assert_nonnull(cur);
+    assert_nonnull(body);
+    cur->body = body;
+    cur->idx = 0;
+    cur->off = 0;
+}
+
+/**
+ * Copy next bytes of the body, may span segments
+ * A file truncated since added is padded with zeros, the size was announced already
+ *
+ * @return      Number of bytes copied, zero once all read
+ *              -1 if a file segment cannot be read(errno will be set)
+ */
+ssize_t body_read(body_cursor_t *cur, char *buf, size_t size)
+{
+    const body_seg_t *seg;
+    size_t n, total = 0;
+    ssize_t m;
+
+    assert_nonnull(cur);
+    assert_nonnull(buf);
+
+    while (total < size && cur->idx < cur->body->n) {
+        seg = &cur->body->segs[cur->idx];
+
+        n = MIN(size - total, seg->size - cur->off);
+        if (seg->data != NULL) {
+            (void) memcpy(buf + total, seg->data + cur->off, n);
+        } else {
+            do {
+                m = pread(seg->fd, buf + total, n, seg->off + (off_t) cur->off);
+            } while (m < 0 && errno == EINTR);
+            if (m < 0) return -1;
+            /* Short read is fine, the rest is read next round */
+            if (m == 0) {
+                (void) memset(buf + total, 0, n);
+            } else {
+                n = (size_t) m;
+            }
+        }
+        total += n;
+        cur->off += n;
+
+        if (cur->off == seg->size) {
+            cur->idx++;
+            cur->off = 0;
+        }
+    }
+
+    return total;
+}
+
+/**
+ * Move read position to `pos' bytes from start of the body
+ * Needed once the transport resends the body(e.g. reused connection was dead)
+ * @return      0 if success  -1 o.w.(errno will be set)
+ */
+int body_seek(body_cursor_t *cur, size_t pos)
+{
+    const body_t *body;
+
+    assert_nonnull(cur);
+    body = cur->body;
+
+    if (pos > body->size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (cur->idx = 0; cur->idx < body->n && pos >= body->segs[cur->idx].size; cur->idx++) {
+        pos -= body->segs[cur->idx].size;
+    }
+    cur->off = pos;
+
+    return 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * Created 191102 lynnl
+ *
+ * Request body as a chain of segments, streamed by the transport in order
+ *  rather than concatenated into one buffer first
+ * Segments are borrowed, they must outlive requests reading them
+ *  a file segment is read by pread(2) upon streaming, nothing loaded up front
+ * Read position lives in a cursor, so a body can be shared by requests
+ */
+
+#ifndef CSENTRY_BODY_H
+#define CSENTRY_BODY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "utils.h"
+
+#define BODY_SEGS_MAX           16u
+
+typedef struct {
+    const char * _nullable data;    /* NULL if a file segment */
+    int fd;
+    off_t off;                  /* File offset of the segment */
+    size_t size;
+} body_seg_t;
+
+typedef struct {
+    body_seg_t segs[BODY_SEGS_MAX];
+    uint32_t n;
+    size_t size;                /* Sum of segment sizes */
+} body_t;
+
+typedef struct {
+    const body_t *body;
+    uint32_t idx;               /* Segment being read */
+    size_t off;                 /* Offset into the segment */
+} body_cursor_t;
+
+void body_init(body_t *);
+int body_add(body_t *, const char *, size_t);
+int body_add_fd(body_t *, int, off_t, size_t);
+size_t body_size(const body_t *);
+
+void body_cursor_init(body_cursor_t *, const body_t *);
+ssize_t body_read(body_cursor_t *, char *, size_t);
+int body_seek(body_cursor_t *, size_t);
+
+#endif /* CSENTRY_BODY_H */
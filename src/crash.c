@@ -0,0 +1,633 @@
+/*
+ * Created 191024 lynnl
+ *
+ * Everything reachable from crash_handler() must be async-signal-safe:
+ *  no malloc(3), no locks, no stdio, only preallocated memory and
+ *  syscalls listed in signal-safety(7)
+ */
+
+/* syscall(2) is a GNU extension on glibc */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#endif
+
+#include "crash.h"
+
+#define CRASH_ALTSTACK_SIZE     (64u * 1024u)
+
+static const int crash_signals[] = {
+    SIGSEGV, SIGABRT, SIGBUS, SIGILL, SIGFPE,
+};
+
+/*
+ * Handler state, all preallocated upon crash_install()
+ * Context buffers are swapped atomically under a lock, the retired one is
+ *  kept one generation longer, and none is freed once a crash in progress
+ *  since the handler may still be reading it
+ */
+static struct {
+    int installed;
+    volatile long crashing;     /* Thread writing the record, 0 if none */
+    pthread_mutex_t mtx;        /* Serializes crash_set_context() */
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];         /* Written first, renamed to path once complete */
+    unwind_fn unwind;
+    stack_t altstack;
+    struct sigaction old[ARRAY_SIZE(crash_signals)];
+    char *context;
+    char *retired;
+    int helper_fd;              /* -1 if no out-of-process helper */
+    pid_t helper_pid;
+} crash = {
+    .mtx = PTHREAD_MUTEX_INITIALIZER,
+    .helper_fd = -1,
+};
+
+/*
+ * Async-signal-safe output helpers
+ */
+
+static void safe_write(int fd, const char *buf, size_t n)
+{
+    ssize_t w;
+
+    while (n != 0) {
+        w = write(fd, buf, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        buf += w;
+        n -= (size_t) w;
+    }
+}
+
+static void safe_puts(int fd, const char *s)
+{
+    safe_write(fd, s, strlen(s));   /* strlen(3) is async-signal-safe */
+}
+
+static void safe_put_num(int fd, const char *key, uint64_t v, int hex)
+{
+    char buf[32];
+    char *p = buf + sizeof(buf);
+    unsigned base = hex ? 16 : 10;
+
+    *--p = '\n';
+    do {
+        *--p = "0123456789abcdef"[v % base];
+        v /= base;
+    } while (v != 0);
+    if (hex) {
+        *--p = 'x';
+        *--p = '0';
+    }
+
+    safe_puts(fd, key);
+    safe_write(fd, p, buf + sizeof(buf) - p);
+}
+
+static void safe_put_int(int fd, const char *key, int64_t v)
+{
+    if (v < 0) {
+        safe_puts(fd, key);
+        safe_put_num(fd, "-", (uint64_t) -v, 0);
+    } else {
+        safe_put_num(fd, key, (uint64_t) v, 0);
+    }
+}
+
+static long current_tid(void)
+{
+#if defined(__linux__)
+    return (long) syscall(SYS_gettid);
+#else
+    return (long) (uintptr_t) pthread_self();
+#endif
+}
+
+static void write_record(int signo, const siginfo_t *info, const void *uctx)
+{
+    void *pcs[CRASH_MAX_FRAMES];
+    uint32_t i, n;
+    struct timespec ts;
+    const char *ctx;
+    int fd;
+
+    /* Stale file of a recycled pid is replaced, never written through a symlink */
+    fd = open(crash.tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        (void) unlink(crash.tmp);
+        fd = open(crash.tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+    }
+    if (fd < 0) return;
+
+    (void) clock_gettime(CLOCK_REALTIME, &ts);
+
+    safe_puts(fd, CRASH_RECORD_MAGIC "\n");
+    safe_put_int(fd, "signal=", signo);
+    safe_put_int(fd, "code=", info != NULL ? info->si_code : 0);
+    safe_put_num(fd, "addr=", info != NULL ? (uintptr_t) info->si_addr : 0, 1);
+    safe_put_int(fd, "pid=", getpid());
+    safe_put_int(fd, "tid=", current_tid());
+    safe_put_int(fd, "time=", ts.tv_sec);
+
+    /* Faulting instruction first, then its callers */
+    n = unwind_signal(crash.unwind, uctx, pcs, ARRAY_SIZE(pcs));
+    for (i = 0; i < n; i++) {
+        safe_put_num(fd, "pc=", (uintptr_t) pcs[i], 1);
+    }
+
+    ctx = __atomic_load_n(&crash.context, __ATOMIC_SEQ_CST);
+    safe_puts(fd, "context=\n");
+    if (ctx != NULL) safe_puts(fd, ctx);
+
+    (void) fsync(fd);
+    (void) close(fd);
+
+    /* Replay never sees a partial record */
+    (void) rename(crash.tmp, crash.path);
+}
+
+/**
+ * Hand the crash over to out-of-process helper and wait for its record
+ * @return      1 if helper wrote the record  0 o.w.
+ */
+static int helper_record(int signo, const siginfo_t *info, const void *uctx)
+{
+    crash_helper_msg_t msg;
+    struct pollfd pfd;
+    char ack;
+    int fd = crash.helper_fd;
+
+    if (fd < 0) return 0;
+
+    (void) memset(&msg, 0, sizeof(msg));
+    msg.type = CRASH_HELPER_CRASH;
+    msg.signo = signo;
+    msg.code = info != NULL ? info->si_code : 0;
+    msg.addr = info != NULL ? (uintptr_t) info->si_addr : 0;
+    msg.tid = current_tid();
+    unwind_ucontext_regs(uctx, &msg.pc, &msg.sp, &msg.fp);
+
+    if (send(fd, &msg, sizeof(msg), MSG_NOSIGNAL) != (ssize_t) sizeof(msg)) return 0;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    for (;;) {
+        switch (poll(&pfd, 1, CRASH_HELPER_TIMEOUT_MS)) {
+        case 1:
+            return read(fd, &ack, 1) == 1 && ack == CRASH_HELPER_DONE;
+        case -1:
+            if (errno == EINTR) continue;
+            /* FALLTHRU */
+        default:
+            return 0;
+        }
+    }
+}
+
+static void crash_handler(int signo, siginfo_t *info, void *uctx)
+{
+    long tid = current_tid();
+    long owner = 0;
+    size_t i;
+
+    /*
+     * Only the first crashing thread writes the record, in-process as a fallback
+     * Sequentially consistent against crash_set_context(), see it
+     */
+    if (__atomic_compare_exchange_n(&crash.crashing, &owner, tid, 0,
+                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        if (!helper_record(signo, info, uctx)) write_record(signo, info, uctx);
+    } else if (owner != tid) {
+        /* Others wait for the re-raise of the first one to end the process */
+        for (;;) (void) pause();
+    }
+
+    /* Hand over to previous handlers(or default action) and re-raise */
+    for (i = 0; i < ARRAY_SIZE(crash_signals); i++) {
+        if (crash_signals[i] == signo) {
+            (void) sigaction(signo, &crash.old[i], NULL);
+            break;
+        }
+    }
+    (void) raise(signo);
+}
+
+/**
+ * Install crash signal handlers on an alternate signal stack
+ * Only one handler set per process, the alternate stack covers the
+ *  installing thread only(sigaltstack(2) is per-thread)
+ *
+ * @path        Spool file the crash record written to
+ * @context     Pre-rendered event json
+ * @unwind      Unwinder used inside the handler
+ * @return      0 if success  -1 o.w.(errno will be set)
+ *              EBUSY if already installed
+ */
+int crash_install(const char *path, const char *context, unwind_fn unwind)
+{
+    struct sigaction sa;
+    void *pcs[1];
+    size_t i;
+
+    assert_nonnull(path);
+    assert_nonnull(context);
+    assert_nonnull(unwind);
+
+    if (crash.installed) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if (strlen(path) + STRLEN(CRASH_TMP_SUFFIX) >= sizeof(crash.tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    (void) strcpy(crash.path, path);
+    (void) strcpy(crash.tmp, path);
+    (void) strcat(crash.tmp, CRASH_TMP_SUFFIX);
+
+    if (crash_set_context(context) != 0) return -1;
+
+    crash.altstack.ss_sp = malloc(CRASH_ALTSTACK_SIZE);
+    if (crash.altstack.ss_sp == NULL) return -1;
+    crash.altstack.ss_size = CRASH_ALTSTACK_SIZE;
+    crash.altstack.ss_flags = 0;
+    if (sigaltstack(&crash.altstack, NULL) != 0) {
+        free(crash.altstack.ss_sp);
+        crash.altstack.ss_sp = NULL;
+        return -1;
+    }
+
+    /* Warm up, backtrace(3) may load libgcc_s upon first call */
+    (void) unwind(pcs, ARRAY_SIZE(pcs));
+    crash.unwind = unwind;
+    crash.crashing = 0;
+
+    (void) memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = crash_handler;
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    (void) sigemptyset(&sa.sa_mask);
+
+    for (i = 0; i < ARRAY_SIZE(crash_signals); i++) {
+        (void) sigaction(crash_signals[i], &sa, &crash.old[i]);
+    }
+
+    crash.installed = 1;
+    return 0;
+}
+
+/**
+ * Restore previous signal handlers
+ * The alternate stack is kept, since the installing thread may still use it
+ */
+void crash_uninstall(void)
+{
+    size_t i;
+
+    if (!crash.installed) return;
+
+    for (i = 0; i < ARRAY_SIZE(crash_signals); i++) {
+        (void) sigaction(crash_signals[i], &crash.old[i], NULL);
+    }
+    crash.installed = 0;
+
+    /* Helper exits once it sees EOF */
+    if (crash.helper_fd >= 0) {
+        (void) close(crash.helper_fd);
+        crash.helper_fd = -1;
+        (void) waitpid(crash.helper_pid, NULL, 0);
+    }
+}
+
+static int helper_send_context(int fd, const char *context)
+{
+    char type = CRASH_HELPER_CONTEXT;
+    struct iovec iov[2];
+    struct msghdr mh;
+
+    iov[0].iov_base = &type;
+    iov[0].iov_len = 1;
+    iov[1].iov_base = (void *) context;
+    iov[1].iov_len = strlen(context);
+
+    (void) memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = ARRAY_SIZE(iov);
+
+    return sendmsg(fd, &mh, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+/**
+ * Launch out-of-process crash helper
+ * Upon crash the helper stops all threads via ptrace(2), walks their
+ *  stacks with process_vm_readv(2) and writes the spool record,
+ *  so the crashing process does nothing but a send(2)
+ * Must be called after crash_install()
+ *
+ * @exe         Helper executable, searched in PATH if no slash in it
+ * @return      0 if success  -1 o.w.(errno will be set)
+ *              EINVAL if handlers not installed
+ *              EBUSY if helper already started
+ *              ECHILD if helper failed to start
+ */
+int crash_helper_start(const char *exe)
+{
+    int e = 0;
+    int sv[2];
+    int bufsz = CRASH_HELPER_MSG_MAX;
+    char pid[24];
+    char fd[24];
+    char ready;
+    struct pollfd pfd;
+    pid_t child;
+
+    assert_nonnull(exe);
+
+    if (!crash.installed) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (crash.helper_fd >= 0) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) != 0) return -1;
+    (void) fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+    /* Context is sent as a single packet, capped by net.core.wmem_max */
+    (void) setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &bufsz, sizeof(bufsz));
+
+    (void) snprintf(pid, sizeof(pid), "%d", (int) getpid());
+    (void) snprintf(fd, sizeof(fd), "%d", sv[1]);
+
+    child = fork();
+    if (child < 0) set_err_jmp(-1, close);
+    if (child == 0) {
+        (void) execlp(exe, exe, pid, fd, crash.path, (char *) NULL);
+        _exit(127);
+    }
+    (void) close(sv[1]);
+    sv[1] = -1;
+
+#if defined(PR_SET_PTRACER)
+    /* Yama ptrace_scope=1 only allows ancestors to trace by default */
+    (void) prctl(PR_SET_PTRACER, child, 0, 0, 0);
+#endif
+
+    pfd.fd = sv[0];
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, CRASH_HELPER_TIMEOUT_MS) != 1 ||
+            read(sv[0], &ready, 1) != 1 || ready != CRASH_HELPER_READY) {
+        (void) kill(child, SIGKILL);
+        (void) waitpid(child, NULL, 0);
+        errno = ECHILD;
+        set_err_jmp(-1, close);
+    }
+
+    /* No context update slips in between */
+    pthread_mutex_lock_safe(&crash.mtx);
+    if (crash.context != NULL && helper_send_context(sv[0], crash.context) != 0) {
+        pthread_mutex_unlock_safe(&crash.mtx);
+        (void) kill(child, SIGKILL);
+        (void) waitpid(child, NULL, 0);
+        set_err_jmp(-1, close);
+    }
+
+    crash.helper_pid = child;
+    __atomic_store_n(&crash.helper_fd, sv[0], __ATOMIC_RELEASE);
+    pthread_mutex_unlock_safe(&crash.mtx);
+
+out_exit:
+    return e;
+
+out_close:
+    if (sv[1] >= 0) (void) close(sv[1]);
+    (void) close(sv[0]);
+    goto out_exit;
+}
+
+/**
+ * Update pre-rendered event json written upon crash
+ * @return      0 if success  -1 o.w.(errno will be set)
+ */
+int crash_set_context(const char *context)
+{
+    char *p, *old;
+    int e = 0;
+
+    assert_nonnull(context);
+
+    p = strdup(context);
+    if (p == NULL) return -1;
+
+    pthread_mutex_lock_safe(&crash.mtx);
+
+    /*
+     * The handler loads context only after it set crashing, so the retired
+     *  one could be read only by a crash which is seen here
+     */
+    old = __atomic_exchange_n(&crash.context, p, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&crash.crashing, __ATOMIC_SEQ_CST) == 0) free(crash.retired);
+    crash.retired = old;
+
+    if (crash.helper_fd >= 0) e = helper_send_context(crash.helper_fd, p);
+
+    pthread_mutex_unlock_safe(&crash.mtx);
+    return e;
+}
+
+static const struct {
+    int signo;
+    const char *name;
+} signal_names[] = {
+    {SIGSEGV, "SIGSEGV"},
+    {SIGABRT, "SIGABRT"},
+    {SIGBUS, "SIGBUS"},
+    {SIGILL, "SIGILL"},
+    {SIGFPE, "SIGFPE"},
+};
+
+const char *crash_signal_name(int signo)
+{
+    size_t i;
+    for (i = 0; i < ARRAY_SIZE(signal_names); i++) {
+        if (signal_names[i].signo == signo) return signal_names[i].name;
+    }
+    return "(unknown)";
+}
+
+/**
+ * Read whole spool file, which must be a regular file owned by us
+ * @return      file content(free(3) after use)  NULL o.w.(errno will be set)
+ *              EPERM if not a regular file or owned by others
+ *              ELOOP if it's a symlink
+ */
+static char * _nullable read_file(const char *path)
+{
+    FILE *fp;
+    struct stat st;
+    char *buf = NULL, *p;
+    size_t n = 0, cap = 0, r;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    if (fstat(fd, &st) != 0) {
+        (void) close(fd);
+        return NULL;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_uid != getuid()) {
+        (void) close(fd);
+        errno = EPERM;
+        return NULL;
+    }
+
+    fp = fdopen(fd, "r");
+    if (fp == NULL) {
+        (void) close(fd);
+        return NULL;
+    }
+
+    do {
+        if (cap - n < 4096) {
+            cap = cap ? cap * 2 : 8192;
+            p = (char *) realloc(buf, cap + 1);
+            if (p == NULL) {
+                free(buf);
+                buf = NULL;
+                goto out_close;
+            }
+            buf = p;
+        }
+        r = fread(buf + n, 1, cap - n, fp);
+        n += r;
+    } while (r != 0);
+    buf[n] = '\0';
+
+out_close:
+    (void) fclose(fp);
+    return buf;
+}
+
+static int parse_hex(const char *str, uintptr_t *val)
+{
+    char *p;
+    unsigned long long t;
+
+    errno = 0;
+    t = strtoull(str, &p, 16);
+    if (errno != 0 || *p != '\0' || p == str) return 0;
+
+    *val = (uintptr_t) t;
+    return 1;
+}
+
+/**
+ * Load a crash record from spool file
+ * @return      0 if success  -1 o.w.(errno will be set)
+ *              EINVAL if malformed
+ *              EPERM or ELOOP if not a regular file owned by us
+ */
+int crash_record_load(const char *path, crash_record_t *rec)
+{
+    int e = 0;
+    char *buf, *line, *next;
+    long long v;
+    uintptr_t x;
+    crash_thread_t *t = NULL;
+
+    assert_nonnull(path);
+    assert_nonnull(rec);
+
+    (void) memset(rec, 0, sizeof(*rec));
+
+    buf = read_file(path);
+    if (buf == NULL) return -1;
+
+    line = buf;
+    next = strchr(line, '\n');
+    if (next == NULL || strncmp(line, CRASH_RECORD_MAGIC "\n", next - line + 1)) {
+        errno = EINVAL;
+        set_err_jmp(-1, free);
+    }
+
+    for (line = next + 1; (next = strchr(line, '\n')) != NULL; line = next + 1) {
+        *next = '\0';
+
+        if (!strcmp(line, "context=")) {
+            rec->context = strdup(next + 1);
+            break;
+        } else if (strprefix(line, "signal=") && parse_llong(line + 7, '\0', 10, &v)) {
+            rec->signo = (int) v;
+        } else if (strprefix(line, "code=") && parse_llong(line + 5, '\0', 10, &v)) {
+            rec->code = (int) v;
+        } else if (strprefix(line, "addr=") && parse_hex(line + 5, &x)) {
+            rec->addr = x;
+        } else if (strprefix(line, "pid=") && parse_llong(line + 4, '\0', 10, &v)) {
+            rec->pid = (pid_t) v;
+        } else if (strprefix(line, "tid=") && parse_llong(line + 4, '\0', 10, &v)) {
+            rec->tid = (long) v;
+        } else if (strprefix(line, "time=") && parse_llong(line + 5, '\0', 10, &v)) {
+            rec->time = v;
+        } else if (strprefix(line, "thread=") && parse_llong(line + 7, '\0', 10, &v)) {
+            t = (crash_thread_t *) realloc(rec->threads, (rec->nthreads + 1) * sizeof(*t));
+            if (t == NULL) set_err_jmp(-1, free);
+            rec->threads = t;
+            t += rec->nthreads++;
+            t->tid = (long) v;
+            t->nframes = 0;
+        } else if (strprefix(line, "pc=") && parse_hex(line + 3, &x)) {
+            /* Frames of the crashing thread come first */
+            if (t != NULL) {
+                if (t->nframes < CRASH_MAX_FRAMES) t->frames[t->nframes++] = x;
+            } else if (rec->nframes < CRASH_MAX_FRAMES) {
+                rec->frames[rec->nframes++] = x;
+            }
+        }
+    }
+
+    if (rec->signo == 0) {
+        errno = EINVAL;
+        set_err_jmp(-1, free);
+    }
+
+out_free:
+    free(buf);
+    if (e != 0) crash_record_free(rec);
+    return e;
+}
+
+void crash_record_free(crash_record_t *rec)
+{
+    assert_nonnull(rec);
+    free(rec->threads);
+    free(rec->context);
+    rec->threads = NULL;
+    rec->nthreads = 0;
+    rec->context = NULL;
+}
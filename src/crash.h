@@ -0,0 +1,78 @@
+/*
+ * Created 191024 lynnl
+ *
+ * Async-signal-safe crash handler and its spool records
+ */
+
+#ifndef CSENTRY_CRASH_H
+#define CSENTRY_CRASH_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <cjson/cJSON.h>
+
+#include "utils.h"
+#include "unwind.h"
+
+#define CRASH_MAX_FRAMES        64
+#define CRASH_SPOOL_SUFFIX      ".crash"
+#define CRASH_TMP_SUFFIX        ".tmp"      /* Record being written, renamed once complete */
+#define CRASH_CLAIM_SUFFIX      ".claim"    /* Record being replayed, see crash_spool_claim() */
+#define CRASH_RECORD_MAGIC      "csentry-crash-v1"
+
+/* Stack of a non-crashing thread in a crash record */
+typedef struct {
+    long tid;
+    uint32_t nframes;
+    uintptr_t frames[CRASH_MAX_FRAMES];
+} crash_thread_t;
+
+/* A crash record parsed from spool file */
+typedef struct {
+    int signo;
+    int code;
+    uintptr_t addr;             /* Fault address */
+    pid_t pid;
+    long tid;
+    int64_t time;               /* Unix epoch */
+    uint32_t nframes;
+    uintptr_t frames[CRASH_MAX_FRAMES];
+    uint32_t nthreads;
+    crash_thread_t * _nullable threads;
+    char * _nullable context;   /* Pre-rendered event json */
+} crash_record_t;
+
+/*
+ * Out-of-process crash helper protocol
+ * Carried over a SOCK_SEQPACKET socketpair, one message per packet
+ *  the first byte denoted message type
+ */
+#define CRASH_HELPER_READY      'R'     /* helper -> client, upon startup */
+#define CRASH_HELPER_CONTEXT    'C'     /* client -> helper, followed by context json */
+#define CRASH_HELPER_CRASH      'X'     /* client -> helper, crash_helper_msg_t */
+#define CRASH_HELPER_DONE       'D'     /* helper -> client, record written */
+
+#define CRASH_HELPER_TIMEOUT_MS 10000
+#define CRASH_HELPER_MSG_MAX    (1u << 20)   /* Largest context accepted */
+
+typedef struct {
+    char type;                  /* CRASH_HELPER_CRASH */
+    int signo;
+    int code;
+    uintptr_t addr;
+    long tid;                   /* Crashing thread */
+    uintptr_t pc;               /* Registers of the interrupted context */
+    uintptr_t sp;
+    uintptr_t fp;
+} crash_helper_msg_t;
+
+int crash_install(const char *, const char *, unwind_fn);
+void crash_uninstall(void);
+int crash_set_context(const char *);
+int crash_helper_start(const char *);
+
+const char *crash_signal_name(int);
+int crash_record_load(const char *, crash_record_t *);
+void crash_record_free(crash_record_t *);
+
+#endif /* CSENTRY_CRASH_H */
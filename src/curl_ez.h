@@ -15,24 +15,27 @@
 #include <cjson/cJSON.h>
 
 #include "utils.h"
+#include "probes.h"
 
 /* see: https://curl.haxx.se/libcurl/c/getinmemory.html */
 struct memory_struct {
     char *data;
     size_t size;
+    size_t cap;                 /* Allocated, kept across requests */
 };
 
-static struct memory_struct null_memory_struct = {NULL, 0};
+static struct memory_struct null_memory_struct = {NULL, 0, 0};
 
 typedef struct {
     CURL *curl;
     struct curl_slist *headers;
-    struct memory_struct chunk;     /* CURLOPT_WRITEDATA */
+    struct memory_struct chunk;     /* Reply body */
+    uint64_t flags;                 /* Of the request being performed */
 } curl_ez_t;
 
 typedef struct {
     int status_code;
-    char *data;
+    const char *data;           /* Borrowed, valid until next request of the handle */
 } curl_ez_reply;
 
 static curl_ez_reply null_curl_ez_reply = {-1, NULL};
@@ -43,16 +46,48 @@ static curl_ez_reply null_curl_ez_reply = {-1, NULL};
         curl_easy_setopt(ez->curl, opt, param);     \
     })
 
+/* Defaults of curl_ez_new(), see curl_ez_set_timeouts() */
+#define CURL_EZ_CONNECT_TIMEOUT_MS      5000L
+#define CURL_EZ_TIMEOUT_MS              30000L
+#define CURL_EZ_KEEPIDLE_S              60L
+#define CURL_EZ_KEEPINTVL_S             30L
+
+/* Reply buffer grows geometrically, excess of a larger reply is dropped */
+#define CURL_EZ_REPLY_SIZE_INIT         256u
+#define CURL_EZ_REPLY_SIZE_MAX          (16u * 1024u)
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 curl_ez_t * _nullable curl_ez_new(void);
 void curl_ez_free(curl_ez_t * _nullable);
+CURLcode curl_ez_set_timeouts(curl_ez_t *, long, long);
 
 CURLcode curl_ez_set_header(curl_ez_t *, const char *);
+void curl_ez_clear_headers(curl_ez_t *);
 
 #define CURL_EZ_FLAG_HTTP_COMPRESS      0x1ULL
+/* Only status code wanted upon success, reply body of a 2xx is never buffered */
+#define CURL_EZ_FLAG_DISCARD_REPLY      0x2ULL
+
+CURLcode curl_ez_post_setup(
+    curl_ez_t *,
+    const char *,
+    const char * _nullable,
+    size_t,
+    uint64_t
+);
+CURLcode curl_ez_post_stream_setup(
+    curl_ez_t *,
+    const char *,
+    curl_read_callback,
+    curl_seek_callback,
+    void *,
+    curl_off_t,
+    uint64_t
+);
+curl_ez_reply curl_ez_post_reply(curl_ez_t *);
 
 curl_ez_reply curl_ez_post(
     curl_ez_t *,
@@ -89,13 +124,20 @@ out_exit2:
     }
 
     e = curl_ez_setopt(ez, CURLOPT_SSL_VERIFYPEER, 0L);
+    if (e == CURLE_OK) e = curl_ez_set_timeouts(ez, CURL_EZ_CONNECT_TIMEOUT_MS, CURL_EZ_TIMEOUT_MS);
     if (e != CURLE_OK) {
         curl_easy_cleanup(ez->curl);
         goto out_exit2;
     }
 
+    /* Detect dead idle connections kept for reuse, e.g. dropped by NAT/firewall */
+    (void) curl_ez_setopt(ez, CURLOPT_TCP_KEEPALIVE, 1L);
+    (void) curl_ez_setopt(ez, CURLOPT_TCP_KEEPIDLE, CURL_EZ_KEEPIDLE_S);
+    (void) curl_ez_setopt(ez, CURLOPT_TCP_KEEPINTVL, CURL_EZ_KEEPINTVL_S);
+
     ez->headers = NULL;
     ez->chunk = null_memory_struct;
+    ez->flags = 0;
 
 out_exit:
     return ez;
@@ -106,12 +148,28 @@ void curl_ez_free(curl_ez_t * _nullable ez)
     if (ez != NULL) {
         curl_slist_free_all(ez->headers);
         curl_easy_cleanup(ez->curl);
-        assert(ez->chunk.data == null_memory_struct.data);
-        assert(ez->chunk.size == null_memory_struct.size);
+        free(ez->chunk.data);
         free(ez);
     }
 }
 
+/**
+ * Bound time of a request, a hung server would stall the caller otherwise
+ *
+ * @connect_ms  Timeout of connection phase(incl. DNS and TLS handshake)
+ * @total_ms    Timeout of the whole request
+ *              zero for libcurl defaults(300s to connect, never time out)
+ * @return      CURLcode(CURLE_OK for success)
+ */
+CURLcode curl_ez_set_timeouts(curl_ez_t *ez, long connect_ms, long total_ms)
+{
+    CURLcode e;
+
+    e = curl_ez_setopt(ez, CURLOPT_CONNECTTIMEOUT_MS, connect_ms);
+    if (e == CURLE_OK) e = curl_ez_setopt(ez, CURLOPT_TIMEOUT_MS, total_ms);
+    return e;
+}
+
 /**
  * Set header for a cURL handle
  * @return  CURLcode(CURLE_OK for success)
@@ -136,43 +194,91 @@ CURLcode curl_ez_set_header(curl_ez_t *ez, const char *header)
     return e;
 }
 
+/**
+ * Drop all headers set by curl_ez_set_header()
+ * Headers are appended otherwise, per-request headers should be cleared first
+ */
+void curl_ez_clear_headers(curl_ez_t *ez)
+{
+    assert_nonnull(ez);
+    (void) curl_ez_setopt(ez, CURLOPT_HTTPHEADER, NULL);
+    curl_slist_free_all(ez->headers);
+    ez->headers = NULL;
+}
+
+/**
+ * Buffer reply body into the handle's buffer, which is reused by next requests
+ * Reply beyond CURL_EZ_REPLY_SIZE_MAX is truncated rather than failing the request
+ */
 static size_t ez_post_write_cb(
         char *contents,
         size_t size,
         size_t nmemb,
         void *userdata)
 {
-    char *ptr;
+    curl_ez_t *ez = (curl_ez_t *) userdata;
+    struct memory_struct *mem;
     size_t n = size * nmemb;
+    size_t cap;
+    long status_code = 0;
+    char *ptr;
 
-    struct memory_struct *mem = (struct memory_struct *) userdata;
-    assert_nonnull(mem);
+    assert_nonnull(ez);
+    mem = &ez->chunk;
+
+    if (ez->flags & CURL_EZ_FLAG_DISCARD_REPLY) {
+        (void) curl_easy_getinfo(ez->curl, CURLINFO_RESPONSE_CODE, &status_code);
+        if (status_code >= 200 && status_code < 300) return size * nmemb;
+    }
 
-    ptr = realloc(mem->data, mem->size + n + 1);
-    if (ptr == NULL) return 0;
+    /* One byte reserved for the terminator */
+    n = MIN(n, CURL_EZ_REPLY_SIZE_MAX - 1 - mem->size);
+    if (mem->size + n + 1 > mem->cap) {
+        cap = mem->cap != 0 ? mem->cap : CURL_EZ_REPLY_SIZE_INIT;
+        while (cap < mem->size + n + 1) cap <<= 1u;
+        cap = MIN(cap, CURL_EZ_REPLY_SIZE_MAX);
+
+        ptr = realloc(mem->data, cap);
+        if (ptr == NULL) return 0;
+        mem->data = ptr;
+        mem->cap = cap;
+    }
 
-    mem->data = ptr;
     (void) memcpy(mem->data + mem->size, contents, n);
     mem->size += n;
     mem->data[mem->size] = '\0';
 
-    return n;
+    return size * nmemb;
 }
 
 /**
- * Perform cURL post with raw data
- * @return      Post reply, you're responsible to free the `data' field
+ * Prepare reply buffer of a new request, allocation of last request is kept
  */
-curl_ez_reply curl_ez_post(
+static CURLcode ez_post_reply_setup(curl_ez_t *ez, uint64_t flags)
+{
+    CURLcode e;
+
+    ez->chunk.size = 0;
+    ez->flags = flags;
+
+    e = curl_ez_setopt(ez, CURLOPT_WRITEFUNCTION, &ez_post_write_cb);
+    if (e == CURLE_OK) e = curl_ez_setopt(ez, CURLOPT_WRITEDATA, ez);
+    return e;
+}
+
+/**
+ * Set up a POST request without performing it(e.g. to be added to a curl_multi)
+ * `data' must be kept valid until the transfer is done
+ * @return      CURLcode(CURLE_OK for success)
+ */
+CURLcode curl_ez_post_setup(
         curl_ez_t *ez,
         const char *url,
         const char * _nullable data,
         size_t size,
         uint64_t flags)
 {
-    CURLcode e;
-    int status_code;
-    curl_ez_reply rep = null_curl_ez_reply;
+    CURLcode e = CURLE_OK;
 
     assert_nonnull(ez);
     assert_nonnull(url);
@@ -194,35 +300,134 @@ curl_ez_reply curl_ez_post(
     if (e != CURLE_OK) goto out_exit;
     e = curl_ez_setopt(ez, CURLOPT_POST, 1);
     if (e != CURLE_OK) goto out_exit;
-    e = curl_ez_setopt(ez, CURLOPT_WRITEFUNCTION, &ez_post_write_cb);
+    e = ez_post_reply_setup(ez, flags);
+
+out_exit:
+    return e;
+}
+
+/**
+ * Set up a POST request whose body is pulled by `read' rather than passed
+ *  as one contiguous buffer, e.g. streamed from a chain of buffers
+ * `seek' rewinds the body in case libcurl has to send it again
+ *  (e.g. a reused connection turned out to be dead)
+ *
+ * @arg         Passed to `read' and `seek', must be kept valid until the transfer is done
+ * @size        Body size, -1 if unknown(sent with chunked transfer encoding over HTTP/1.1)
+ * @flags       CURL_EZ_FLAG_HTTP_COMPRESS isn't supported
+ * @return      CURLcode(CURLE_OK for success)
+ *              CURLE_BAD_FUNCTION_ARGUMENT if CURL_EZ_FLAG_HTTP_COMPRESS given
+ */
+CURLcode curl_ez_post_stream_setup(
+        curl_ez_t *ez,
+        const char *url,
+        curl_read_callback read,
+        curl_seek_callback seek,
+        void *arg,
+        curl_off_t size,
+        uint64_t flags)
+{
+    CURLcode e;
+
+    assert_nonnull(ez);
+    assert_nonnull(url);
+    assert_nonnull(read);
+    assert_nonnull(seek);
+
+    /* Body is produced by the caller, compress it before it gets here */
+    if (flags & CURL_EZ_FLAG_HTTP_COMPRESS) {
+        e = CURLE_BAD_FUNCTION_ARGUMENT;
+        goto out_exit;
+    }
+
+    /* CURLOPT_POSTFIELDS takes precedence over read callback */
+    e = curl_ez_setopt(ez, CURLOPT_POSTFIELDS, NULL);
+    if (e != CURLE_OK) goto out_exit;
+    e = curl_ez_setopt(ez, CURLOPT_POST, 1L);
     if (e != CURLE_OK) goto out_exit;
-    e = curl_ez_setopt(ez, CURLOPT_WRITEDATA, &ez->chunk);
+    e = curl_ez_setopt(ez, CURLOPT_READFUNCTION, read);
+    if (e != CURLE_OK) goto out_exit;
+    e = curl_ez_setopt(ez, CURLOPT_READDATA, arg);
+    if (e != CURLE_OK) goto out_exit;
+    e = curl_ez_setopt(ez, CURLOPT_SEEKFUNCTION, seek);
+    if (e != CURLE_OK) goto out_exit;
+    e = curl_ez_setopt(ez, CURLOPT_SEEKDATA, arg);
+    if (e != CURLE_OK) goto out_exit;
+    e = curl_ez_setopt(ez, CURLOPT_POSTFIELDSIZE_LARGE, size);
     if (e != CURLE_OK) goto out_exit;
 
-    e = curl_easy_perform(ez->curl);
+    if (size < 0) {
+        e = curl_ez_set_header(ez, "Transfer-Encoding: chunked");
+        if (e != CURLE_OK) goto out_exit;
+    }
+    /* libcurl waits up to 1s for "100 Continue" of large(or chunked) bodies otherwise */
+    e = curl_ez_set_header(ez, "Expect:");
     if (e != CURLE_OK) goto out_exit;
 
-    e = curl_easy_getinfo(ez->curl, CURLINFO_RESPONSE_CODE, &status_code);
+    e = curl_ez_setopt(ez, CURLOPT_URL, url);
     if (e != CURLE_OK) goto out_exit;
+    e = ez_post_reply_setup(ez, flags);
 
-    assert_nonnull(ez->chunk.data);
-    assert(ez->chunk.size != 0);
+out_exit:
+    return e;
+}
 
-    rep.data = strdup(ez->chunk.data);
-    if (rep.data == NULL) goto out_exit;
+/**
+ * Collect reply of a finished POST request
+ * @return      Post reply, `data' is borrowed from the handle
+ *              NULL if reply body is empty or discarded
+ */
+curl_ez_reply curl_ez_post_reply(curl_ez_t *ez)
+{
+    CURLcode e;
+    long status_code;   /* CURLINFO_RESPONSE_CODE takes a long */
+    curl_ez_reply rep = null_curl_ez_reply;
 
-    free(ez->chunk.data);
-    ez->chunk = null_memory_struct;
+    assert_nonnull(ez);
+
+    e = curl_easy_getinfo(ez->curl, CURLINFO_RESPONSE_CODE, &status_code);
+    if (e != CURLE_OK) goto out_exit;
+
+    /* Reply body can be empty(e.g. 429 Too Many Requests) */
+    if (ez->chunk.size != 0) rep.data = ez->chunk.data;
 
     assert(status_code > 0);
-    rep.status_code = status_code;
+    rep.status_code = (int) status_code;
+out_exit:
+    return rep;
+}
+
+/**
+ * Perform cURL post with raw data
+ * @return      Post reply, see curl_ez_post_reply()
+ */
+curl_ez_reply curl_ez_post(
+        curl_ez_t *ez,
+        const char *url,
+        const char * _nullable data,
+        size_t size,
+        uint64_t flags)
+{
+    CURLcode e;
+    curl_ez_reply rep = null_curl_ez_reply;
+
+    e = curl_ez_post_setup(ez, url, data, size, flags);
+    if (e != CURLE_OK) goto out_exit;
+
+    PROBE3(http_entry, ez, url, size);
+    e = curl_easy_perform(ez->curl);
+    PROBE2(http_return, ez, e);
+    /* Partial reply of a failed transfer is ignored */
+    if (e != CURLE_OK) goto out_exit;
+
+    rep = curl_ez_post_reply(ez);
 out_exit:
     return rep;
 }
 
 /**
  * Perform cURL post with json data
- * @return      Post reply, you're responsible to free the `data' field
+ * @return      Post reply, see curl_ez_post_reply()
  */
 curl_ez_reply curl_ez_post_json(
         curl_ez_t *ez,
@@ -0,0 +1,292 @@
+/*
+ * Created 191103 lynnl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <cjson/cJSON.h>
+
+#include "log.h"
+#include "envelope.h"
+
+#define ATTACHMENT_DEFAULT_NAME     "attachment"
+#define ATTACHMENT_DEFAULT_TYPE     "application/octet-stream"
+
+/**
+ * Create an attachment referring to either a file path or a file descriptor
+ * Nothing is read until an envelope is built
+ *
+ * @path        Opened upon every send, NULL if `fd' specified
+ * @fd          Duplicated(caller may close it afterwards), -1 if `path' specified
+ * @filename    Defaults to base name of `path'
+ * @content_type    Defaults to application/octet-stream
+ * @return      Attachment(refcount 1)  NULL o.w.(errno will be set)
+ */
+attachment_t * _nullable attachment_new(
+        const char * _nullable path,
+        int fd,
+        const char * _nullable filename,
+        const char * _nullable content_type)
+{
+    attachment_t *att;
+    const char *slash;
+    size_t n1, n2, n3;
+    char *p;
+
+    if ((path == NULL) == (fd < 0) || (path != NULL && *path == '\0')) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (filename == NULL) {
+        slash = path != NULL ? strrchr(path, '/') : NULL;
+        filename = slash != NULL ? slash + 1 : (path != NULL ? path : ATTACHMENT_DEFAULT_NAME);
+    }
+    if (content_type == NULL) content_type = ATTACHMENT_DEFAULT_TYPE;
+
+    n1 = path != NULL ? strlen(path) + 1 : 0;
+    n2 = strlen(filename) + 1;
+    n3 = strlen(content_type) + 1;
+
+    att = (attachment_t *) malloc(sizeof(*att) + n1 + n2 + n3);
+    if (att == NULL) return NULL;
+
+    att->fd = -1;
+    if (fd >= 0) {
+        att->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (att->fd < 0) {
+            free(att);
+            return NULL;
+        }
+    }
+
+    p = (char *) (att + 1);
+    att->path = NULL;
+    if (path != NULL) {
+        att->path = memcpy(p, path, n1);
+        p += n1;
+    }
+    att->filename = memcpy(p, filename, n2);
+    att->content_type = memcpy(p + n2, content_type, n3);
+    att->refs = 1;
+
+    return att;
+}
+
+attachment_t *attachment_get(attachment_t *att)
+{
+    assert_nonnull(att);
+    (void) __atomic_add_fetch(&att->refs, 1, __ATOMIC_RELAXED);
+    return att;
+}
+
+void attachment_put(attachment_t * _nullable att)
+{
+    if (att != NULL && __atomic_sub_fetch(&att->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (att->fd >= 0) (void) close(att->fd);
+        free(att);
+    }
+}
+
+/**
+ * Read a file whose size is unknown(e.g. pipes, procfs), CSENTRY_ATTACHMENT_SIZE_MAX at most
+ * @return      Bytes read(free(3) after use)  NULL o.w.(errno will be set)
+ */
+static char * _nullable read_capped(int fd, size_t *size)
+{
+    char *buf, *p;
+    size_t n = 0;
+    ssize_t m;
+
+    buf = (char *) malloc(CSENTRY_ATTACHMENT_SIZE_MAX);
+    if (buf == NULL) return NULL;
+
+    while (n < CSENTRY_ATTACHMENT_SIZE_MAX) {
+        m = pread(fd, buf + n, CSENTRY_ATTACHMENT_SIZE_MAX - n, (off_t) n);
+        if (m < 0 && errno == ESPIPE) m = read(fd, buf + n, CSENTRY_ATTACHMENT_SIZE_MAX - n);
+        if (m < 0 && errno == EINTR) continue;
+        /* Nothing more to read without blocking the worker */
+        if (m < 0 && errno == EAGAIN) break;
+        if (m < 0) {
+            free(buf);
+            return NULL;
+        }
+        if (m == 0) break;
+        n += (size_t) m;
+    }
+
+    /* Typically far smaller than the cap */
+    p = (char *) realloc(buf, n != 0 ? n : 1);
+    if (p != NULL) buf = p;
+
+    *size = n;
+    return buf;
+}
+
+/**
+ * @return      Item header in JSON  NULL if ENOMEM
+ */
+static char * _nullable item_header(size_t size, const attachment_t * _nullable att)
+{
+    cJSON *obj;
+    char *str = NULL;
+
+    obj = cJSON_CreateObject();
+    if (obj == NULL) return NULL;
+
+    if (cJSON_AddStringToObject(obj, "type", att != NULL ? "attachment" : "event") == NULL ||
+            cJSON_AddNumberToObject(obj, "length", (double) size) == NULL) {
+        goto out_delete;
+    }
+    if (att != NULL && (cJSON_AddStringToObject(obj, "filename", att->filename) == NULL ||
+                cJSON_AddStringToObject(obj, "content_type", att->content_type) == NULL)) {
+        goto out_delete;
+    }
+
+    str = cJSON_PrintUnformatted(obj);
+out_delete:
+    cJSON_Delete(obj);
+    return str;
+}
+
+/**
+ * Attach a file to the envelope(item header excluded)
+ * Regular files are streamed from where they are, only the tail of
+ *  a large one is taken(e.g. logs)
+ *
+ * @return      0 if success  -1 o.w.(errno will be set)
+ */
+static int envelope_open(envelope_t *env, uint32_t i, int *fd, off_t *off, size_t *size)
+{
+    attachment_t *att = env->atts[i];
+    struct stat st;
+
+    *fd = att->fd;
+    if (*fd < 0) {
+        /* Never block the worker on a FIFO */
+        *fd = open(att->path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+        if (*fd < 0) return -1;
+        env->fds[i] = *fd;
+    }
+
+    if (fstat(*fd, &st) != 0) return -1;
+
+    /* Size of procfs files is only known once read */
+    if (S_ISREG(st.st_mode) && st.st_size != 0) {
+        *size = (size_t) MIN((uint64_t) st.st_size, CSENTRY_ATTACHMENT_SIZE_MAX);
+        *off = st.st_size - (off_t) *size;
+        return 0;
+    }
+
+    *off = 0;
+    env->bufs[i] = read_capped(*fd, size);
+    return env->bufs[i] != NULL ? 0 : -1;
+}
+
+/**
+ * Build an envelope of an event and its attachments
+ * Attachments which cannot be read are skipped, the event is still sent
+ *
+ * @data        Serialized event, must outlive the envelope
+ * @atts        References are taken
+ * @return      0 if success  -1 o.w.(errno will be set)
+ */
+int envelope_build(
+        envelope_t *env,
+        const uuid_t id,
+        const char *data,
+        size_t size,
+        attachment_t * const *atts,
+        uint32_t n)
+{
+    char *hdrs[CSENTRY_ATTACHMENTS_MAX + 1];
+    int fds[CSENTRY_ATTACHMENTS_MAX];
+    off_t offs[CSENTRY_ATTACHMENTS_MAX];
+    size_t sizes[CSENTRY_ATTACHMENTS_MAX];
+    uuid_string_t uu;
+    char head[64];
+    size_t len, pos;
+    uint32_t i;
+    int e = 0;
+
+    assert_nonnull(env);
+    assert_nonnull(data);
+    assert(n <= CSENTRY_ATTACHMENTS_MAX);
+
+    (void) memset(env, 0, sizeof(*env));
+    body_init(&env->body);
+    for (i = 0; i < CSENTRY_ATTACHMENTS_MAX; i++) env->fds[i] = -1;
+    (void) memset(hdrs, 0, sizeof(hdrs));
+
+    env->n = n;
+    for (i = 0; i < n; i++) env->atts[i] = attachment_get(atts[i]);
+
+    uuid_unparse_lower(id, uu);
+    (void) snprintf(head, sizeof(head), "{\"event_id\":\"%s\"}\n", uu);
+
+    hdrs[0] = item_header(size, NULL);
+    if (hdrs[0] == NULL) set_err_jmp(-1, free);
+    len = strlen(head) + strlen(hdrs[0]) + 1;
+
+    for (i = 0; i < n; i++) {
+        if (envelope_open(env, i, &fds[i], &offs[i], &sizes[i]) != 0) {
+            LOG_WARN("Skip attachment %s  errno: %d", env->atts[i]->filename, errno);
+            continue;
+        }
+        hdrs[i + 1] = item_header(sizes[i], env->atts[i]);
+        if (hdrs[i + 1] == NULL) set_err_jmp(-1, free);
+        len += strlen(hdrs[i + 1]) + 2;     /* +2 for newlines around */
+    }
+
+    env->frame = (char *) malloc(len + 1);
+    if (env->frame == NULL) set_err_jmp(-1, free);
+
+    /* Each header is joined with newlines around its payload */
+    pos = (size_t) sprintf(env->frame, "%s%s\n", head, hdrs[0]);
+    (void) body_add(&env->body, env->frame, pos);
+    (void) body_add(&env->body, data, size);
+
+    for (i = 0; i < n; i++) {
+        if (hdrs[i + 1] == NULL) continue;
+
+        len = (size_t) sprintf(env->frame + pos, "\n%s\n", hdrs[i + 1]);
+        (void) body_add(&env->body, env->frame + pos, len);
+        pos += len;
+
+        if (env->bufs[i] != NULL) {
+            (void) body_add(&env->body, env->bufs[i], sizes[i]);
+        } else {
+            (void) body_add_fd(&env->body, fds[i], offs[i], sizes[i]);
+        }
+    }
+
+out_free:
+    for (i = 0; i <= n; i++) free(hdrs[i]);
+    if (e != 0) {
+        envelope_free(env);
+        errno = ENOMEM;
+    }
+    return e;
+}
+
+void envelope_free(envelope_t *env)
+{
+    uint32_t i;
+
+    assert_nonnull(env);
+
+    for (i = 0; i < env->n; i++) {
+        if (env->fds[i] >= 0) (void) close(env->fds[i]);
+        free(env->bufs[i]);
+        attachment_put(env->atts[i]);
+    }
+    free(env->frame);
+    env->n = 0;
+    env->frame = NULL;
+}
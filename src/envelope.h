@@ -0,0 +1,52 @@
+/*
+ * Created 191103 lynnl
+ *
+ * Sentry envelope of an event along with its attachments
+ *  {"event_id":ID}\n
+ *  {"type":"event","length":N}\nEVENT\n
+ *  {"type":"attachment","length":N,"filename":NAME,"content_type":TYPE}\nDATA\n
+ *  ...
+ * Attachments are mere references until the envelope is built by the worker
+ *  regular files are then streamed by the transport rather than loaded
+ * see: https://develop.sentry.dev/sdk/envelopes/
+ */
+
+#ifndef CSENTRY_ENVELOPE_H
+#define CSENTRY_ENVELOPE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <uuid/uuid.h>
+
+#include "utils.h"
+#include "body.h"
+#include "csentry.h"
+
+#define ENVELOPE_CONTENT_TYPE   "application/x-sentry-envelope"
+
+/* Refcounted, shared by the client and envelopes being sent */
+typedef struct {
+    uint32_t refs;
+    int fd;                     /* Owned, -1 if opened by path upon send */
+    const char * _nullable path;
+    const char *filename;
+    const char *content_type;
+} attachment_t;
+
+typedef struct {
+    body_t body;
+    uint32_t n;
+    attachment_t *atts[CSENTRY_ATTACHMENTS_MAX];
+    int fds[CSENTRY_ATTACHMENTS_MAX];   /* Opened by path, -1 if none */
+    char * _nullable bufs[CSENTRY_ATTACHMENTS_MAX]; /* Files of unknown size, read in */
+    char * _nullable frame;     /* Envelope and item headers */
+} envelope_t;
+
+attachment_t * _nullable attachment_new(const char * _nullable, int, const char * _nullable, const char * _nullable);
+attachment_t *attachment_get(attachment_t *);
+void attachment_put(attachment_t * _nullable);
+
+int envelope_build(envelope_t *, const uuid_t, const char *, size_t, attachment_t * const *, uint32_t);
+void envelope_free(envelope_t *);
+
+#endif /* CSENTRY_ENVELOPE_H */
@@ -0,0 +1,103 @@
+/*
+ * Created 191020 lynnl
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "event.h"
+
+/**
+ * Create an event which takes ownership of `json'
+ * @frames      Raw instruction addresses of the backtrace(if any)
+ * @return      NULL if ENOMEM
+ */
+event_t * _nullable event_new(
+        cJSON *json,
+        const uuid_t id,
+        uint32_t options,
+        void * const * _nullable frames,
+        uint32_t nframes)
+{
+    event_t *ev;
+
+    assert_nonnull(json);
+    assert(!!frames | !nframes);
+
+    ev = (event_t *) malloc(sizeof(*ev) + nframes * sizeof(*frames));
+    if (ev != NULL) {
+        (void) memset(ev, 0, sizeof(*ev));
+        ev->json = json;
+        uuid_copy(ev->id, id);
+        ev->options = options;
+        ev->count = 1;
+        ev->nframes = nframes;
+        if (nframes != 0) {
+            (void) memcpy(ev->frames, frames, nframes * sizeof(*frames));
+        }
+    }
+
+    return ev;
+}
+
+void event_free(event_t * _nullable ev)
+{
+    if (ev != NULL) {
+        cJSON_Delete(ev->json);
+        free(ev->spool);
+        free(ev->threads);
+        free(ev);
+    }
+}
+
+void event_queue_push(event_queue_t *q, event_t *ev)
+{
+    assert_nonnull(q);
+    assert_nonnull(ev);
+
+    ev->next = NULL;
+    if (q->tail != NULL) {
+        q->tail->next = ev;
+    } else {
+        q->head = ev;
+    }
+    q->tail = ev;
+    q->len++;
+    if (ev->deadline != 0) q->held++;
+}
+
+event_t * _nullable event_queue_pop(event_queue_t *q)
+{
+    event_t *ev;
+
+    assert_nonnull(q);
+
+    ev = q->head;
+    if (ev != NULL) {
+        q->head = ev->next;
+        if (q->head == NULL) q->tail = NULL;
+        ev->next = NULL;
+        q->len--;
+        if (ev->deadline != 0) q->held--;
+    }
+
+    return ev;
+}
+
+/**
+ * @return      Oldest queued event with given fingerprint  NULL if none
+ */
+event_t * _nullable event_queue_find(event_queue_t *q, uint64_t fingerprint)
+{
+    event_t *ev;
+
+    assert_nonnull(q);
+
+    if (fingerprint == 0) return NULL;
+
+    for (ev = q->head; ev != NULL; ev = ev->next) {
+        if (ev->fingerprint == fingerprint) break;
+    }
+
+    return ev;
+}
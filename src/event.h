@@ -0,0 +1,56 @@
+/*
+ * Created 191020 lynnl
+ *
+ * Captured events pending for POST
+ */
+
+#ifndef CSENTRY_EVENT_H
+#define CSENTRY_EVENT_H
+
+#include <stdint.h>
+#include <uuid/uuid.h>
+#include <cjson/cJSON.h>
+
+#include "utils.h"
+#include "threads.h"
+
+typedef struct event {
+    struct event *next;
+
+    cJSON *json;                /* Event payload */
+    uuid_t id;
+    uint32_t options;
+
+    uint64_t fingerprint;       /* Coalescing key, zero if not coalescible */
+    uint32_t count;             /* Occurrences merged into this event */
+    uint64_t deadline;          /* Monotonic ns the event held until */
+    char last_seen[ISO_8601_BUFSZ];
+
+    char * _nullable spool;     /* Spool file removed once POSTed */
+
+    /* Stacks of other threads, enclosed as threads interface before POST */
+    long tid;                   /* Capturing thread */
+    uint32_t nthreads;
+    thread_stack_t * _nullable threads;
+
+    /* Raw instruction addresses, symbolized right before POST */
+    uint32_t nframes;
+    void *frames[];
+} event_t;
+
+/* FIFO of events, protected by the owner's lock */
+typedef struct {
+    event_t *head;
+    event_t *tail;
+    uint32_t len;
+    uint32_t held;              /* Events of them held for coalescing */
+} event_queue_t;
+
+event_t * _nullable event_new(cJSON *, const uuid_t, uint32_t, void * const * _nullable, uint32_t);
+void event_free(event_t * _nullable);
+
+void event_queue_push(event_queue_t *, event_t *);
+event_t * _nullable event_queue_pop(event_queue_t *);
+event_t * _nullable event_queue_find(event_queue_t *, uint64_t);
+
+#endif /* CSENTRY_EVENT_H */
@@ -0,0 +1,537 @@
+/*
+ * Created 191101 lynnl
+ *
+ * Each slot owns an easy handle, which is reused across requests
+ * Easy handles share DNS cache, TLS sessions and connection cache
+ *  through the transport's share handle, a new slot(or client) needs
+ *  neither lookup nor handshake once any of them reached the server
+ * Request bodies are borrowed, callers release them upon completion
+ *  each request streams its body from the chain through its own cursor
+ * Synchronous requests come from any thread with short-lived easy handles
+ *  their connections survive in a process-wide share handle with locks
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "http.h"
+#include "curl_ez.h"
+
+/* curl_multi_poll(3) and curl_multi_wakeup(3) since 7.68.0 */
+#if LIBCURL_VERSION_NUM >= 0x074400
+#define HTTP_HAVE_MULTI_POLL
+#endif
+
+#define HTTP_WAIT_MAX_MS        50u     /* Unless woken up by curl_multi_wakeup(3) */
+
+typedef struct {
+    curl_ez_t *ez;              /* Created upon first use */
+    int busy;
+    int warmup;                 /* See http_preconnect() */
+    body_cursor_t cur;          /* CURLOPT_READDATA */
+    size_t size;
+    void *udata;
+    uint64_t start;
+} http_slot_t;
+
+struct http {
+    CURLM *multi;
+    CURLSH *share;
+    uint32_t inflight;
+    /* Applied to a slot upon submission */
+    uint32_t connect_timeout_ms;
+    uint32_t timeout_ms;
+    http_slot_t slots[HTTP_CONCURRENCY_MAX];
+};
+
+/*
+ * Share handle of synchronous requests, see http_post_sync()
+ * Created lazily, never cleaned up since any thread may be using it
+ */
+static struct {
+    pthread_mutex_t mtx;        /* Protects creation */
+    pthread_mutex_t locks[CURL_LOCK_DATA_LAST];
+    CURLSH *share;
+    pid_t pid;                  /* Connections of the parent are never reused by a child */
+} sync_share = {
+    .mtx = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void sync_share_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *arg)
+{
+    UNUSED(curl);
+    UNUSED(access);
+    UNUSED(arg);
+    pthread_mutex_lock_safe(&sync_share.locks[data]);
+}
+
+static void sync_share_unlock(CURL *curl, curl_lock_data data, void *arg)
+{
+    UNUSED(curl);
+    UNUSED(arg);
+    pthread_mutex_unlock_safe(&sync_share.locks[data]);
+}
+
+/**
+ * @return      Share handle of synchronous requests  NULL if ENOMEM
+ */
+static CURLSH * _nullable sync_share_get(void)
+{
+    CURLSH *share;
+    int i;
+
+    pthread_mutex_lock_safe(&sync_share.mtx);
+
+    if (sync_share.share == NULL || sync_share.pid != getpid()) {
+        /* One inherited from the parent is abandoned, its locks may be held */
+        for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+            (void) pthread_mutex_init(&sync_share.locks[i], NULL);
+        }
+
+        sync_share.share = curl_share_init();
+        if (sync_share.share != NULL) {
+            (void) curl_share_setopt(sync_share.share, CURLSHOPT_LOCKFUNC, sync_share_lock);
+            (void) curl_share_setopt(sync_share.share, CURLSHOPT_UNLOCKFUNC, sync_share_unlock);
+            (void) curl_share_setopt(sync_share.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+            (void) curl_share_setopt(sync_share.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+            (void) curl_share_setopt(sync_share.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+            sync_share.pid = getpid();
+        }
+    }
+    share = sync_share.share;
+
+    pthread_mutex_unlock_safe(&sync_share.mtx);
+    return share;
+}
+
+/**
+ * @return      HTTP transport  NULL o.w.(errno will be set)
+ */
+http_t * _nullable http_new(void)
+{
+    http_t *http;
+
+    http = (http_t *) calloc(1, sizeof(*http));
+    if (http == NULL) return NULL;
+
+    http->multi = curl_multi_init();
+    http->share = curl_share_init();
+    if (http->multi == NULL || http->share == NULL) {
+        if (http->share != NULL) (void) curl_share_cleanup(http->share);
+        if (http->multi != NULL) (void) curl_multi_cleanup(http->multi);
+        free(http);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /* Requests to the same host share one HTTP/2 connection if possible */
+    (void) curl_multi_setopt(http->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+    /* Handles are driven by a single thread, no lock callbacks needed */
+    (void) curl_share_setopt(http->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    (void) curl_share_setopt(http->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    (void) curl_share_setopt(http->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+    http->connect_timeout_ms = HTTP_CONNECT_TIMEOUT_DEFAULT_MS;
+    http->timeout_ms = HTTP_TIMEOUT_DEFAULT_MS;
+
+    return http;
+}
+
+/**
+ * Transfers in flight are aborted, their bodies and `udata' aren't released
+ */
+void http_free(http_t * _nullable http)
+{
+    http_slot_t *slot;
+    uint32_t i;
+
+    if (http == NULL) return;
+
+    for (i = 0; i < ARRAY_SIZE(http->slots); i++) {
+        slot = &http->slots[i];
+        if (slot->ez == NULL) continue;
+
+        if (slot->busy) {
+            (void) curl_multi_remove_handle(http->multi, slot->ez->curl);
+        }
+        curl_ez_free(slot->ez);
+    }
+
+    /* Share handle can only be cleaned up once no easy handle uses it */
+    (void) curl_share_cleanup(http->share);
+    (void) curl_multi_cleanup(http->multi);
+    free(http);
+}
+
+uint32_t http_inflight(const http_t *http)
+{
+    assert_nonnull(http);
+    return http->inflight;
+}
+
+/**
+ * Limits of each user(e.g. concurrency and bytes in flight) are up to the caller
+ * @return      1 if a request can be submitted(a slot is idle)  0 o.w.
+ */
+int http_ready(const http_t *http)
+{
+    assert_nonnull(http);
+    return http->inflight < HTTP_CONCURRENCY_MAX;
+}
+
+/**
+ * @return      Easy handle of the slot  NULL if ENOMEM
+ */
+static curl_ez_t * _nullable http_slot_ez(http_t *http, http_slot_t *slot)
+{
+    if (slot->ez != NULL) return slot->ez;
+
+    slot->ez = curl_ez_new();
+    if (slot->ez == NULL) return NULL;
+
+    /*
+     * Negotiate HTTP/2 over TLS(HTTP/1.1 for plain HTTP)
+     * Wait for a pending connection to tell whether it multiplexes
+     *  rather than opening another one for each concurrent request
+     */
+    (void) curl_ez_setopt(slot->ez, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+    (void) curl_ez_setopt(slot->ez, CURLOPT_PIPEWAIT, 1L);
+    (void) curl_ez_setopt(slot->ez, CURLOPT_PRIVATE, slot);
+    (void) curl_ez_setopt(slot->ez, CURLOPT_SHARE, http->share);
+
+    return slot->ez;
+}
+
+/**
+ * @return      An idle slot with its easy handle  NULL o.w.(errno will be set)
+ */
+static http_slot_t * _nullable http_slot_get(http_t *http)
+{
+    http_slot_t *slot;
+    uint32_t i;
+
+    for (i = 0; i < ARRAY_SIZE(http->slots); i++) {
+        slot = &http->slots[i];
+        if (slot->busy) continue;
+
+        if (http_slot_ez(http, slot) == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        (void) curl_ez_set_timeouts(slot->ez, (long) http->connect_timeout_ms, (long) http->timeout_ms);
+        return slot;
+    }
+
+    errno = EBUSY;
+    return NULL;
+}
+
+/**
+ * Set timeouts of requests submitted afterwards
+ * see: curl_ez_set_timeouts()
+ */
+void http_set_timeouts(http_t *http, uint32_t connect_ms, uint32_t total_ms)
+{
+    assert_nonnull(http);
+    http->connect_timeout_ms = connect_ms;
+    http->timeout_ms = total_ms;
+}
+
+/**
+ * Warm up DNS cache, connection and TLS session for the URL in background
+ * A HEAD request is used, so the connection lands in the connection cache
+ *  for upcoming requests(connections of CURLOPT_CONNECT_ONLY don't)
+ * Its completion isn't reported, yet it counts as in flight
+ *
+ * @return      0 if success  -1 o.w.(errno will be set)
+ */
+int http_preconnect(http_t *http, const char *url)
+{
+    http_slot_t *slot;
+
+    assert_nonnull(http);
+    assert_nonnull(url);
+
+    slot = http_slot_get(http);
+    if (slot == NULL) return -1;
+
+    /* Headers of last request(e.g. Transfer-Encoding) don't apply to HEAD */
+    curl_ez_clear_headers(slot->ez);
+    if (curl_ez_setopt(slot->ez, CURLOPT_URL, url) != CURLE_OK ||
+            curl_ez_setopt(slot->ez, CURLOPT_NOBODY, 1L) != CURLE_OK) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (curl_multi_add_handle(http->multi, slot->ez->curl) != CURLM_OK) {
+        (void) curl_ez_setopt(slot->ez, CURLOPT_NOBODY, 0L);
+        errno = EIO;
+        return -1;
+    }
+
+    slot->busy = 1;
+    slot->warmup = 1;
+    slot->size = 0;
+    slot->start = monotonic_ns();
+    http->inflight++;
+
+    return 0;
+}
+
+static size_t http_read_cb(char *buf, size_t size, size_t nitems, void *arg)
+{
+    ssize_t n = body_read((body_cursor_t *) arg, buf, size * nitems);
+    return n >= 0 ? (size_t) n : CURL_READFUNC_ABORT;
+}
+
+static int http_seek_cb(void *arg, curl_off_t off, int origin)
+{
+    if (origin != SEEK_SET || off < 0) return CURL_SEEKFUNC_CANTSEEK;
+    return body_seek((body_cursor_t *) arg, (size_t) off) == 0 ? CURL_SEEKFUNC_OK : CURL_SEEKFUNC_FAIL;
+}
+
+/**
+ * Submit a POST request, its completion is reported by http_perform()
+ * Body is streamed from its segments, never copied into one buffer
+ *
+ * @auth        X-Sentry-Auth header line
+ * @ctype       Content-Type header value
+ * @body        Must be kept valid until done, e.g. shared by other requests
+ * @udata       Passed back in http_result_t
+ * @return      0 if success  -1 o.w.(errno will be set)
+ *              EBUSY if all slots are in flight
+ */
+int http_submit(
+        http_t *http,
+        const char *url,
+        const char *auth,
+        const char *ctype,
+        const body_t *body,
+        void * _nullable udata)
+{
+    char hdr[64];
+    http_slot_t *slot;
+    curl_ez_t *ez;
+    size_t size;
+
+    assert_nonnull(http);
+    assert_nonnull(url);
+    assert_nonnull(auth);
+    assert_nonnull(ctype);
+    assert_nonnull(body);
+
+    (void) snprintf(hdr, sizeof(hdr), "Content-Type: %s", ctype);
+
+    slot = http_slot_get(http);
+    if (slot == NULL) return -1;
+    ez = slot->ez;
+    size = body_size(body);
+    body_cursor_init(&slot->cur, body);
+
+    /* X-Sentry-Auth carries a timestamp, never reuse headers of last request */
+    curl_ez_clear_headers(ez);
+    if (curl_ez_set_header(ez, auth) != CURLE_OK ||
+            curl_ez_set_header(ez, hdr) != CURLE_OK ||
+            curl_ez_post_stream_setup(ez, url, http_read_cb, http_seek_cb,
+                                &slot->cur, (curl_off_t) size, CURL_EZ_FLAG_DISCARD_REPLY) != CURLE_OK) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (curl_multi_add_handle(http->multi, ez->curl) != CURLM_OK) {
+        errno = EIO;
+        return -1;
+    }
+
+    slot->busy = 1;
+    slot->size = size;
+    slot->udata = udata;
+    slot->start = monotonic_ns();
+    http->inflight++;
+
+    PROBE3(http_entry, ez, url, size);
+
+    return 0;
+}
+
+/**
+ * Perform a POST request on the calling thread, bypassing the transport
+ * Caches of the transport are driven by the worker without locks,
+ *  hence connections are kept apart in a locked share handle
+ *
+ * @timeout_ms  Deadline of the whole request(incl. connection), non-zero
+ * @done        Called with the result before return, `reply' is only valid meanwhile
+ * @return      0 if performed(failed or not)  -1 o.w.(errno will be set)
+ */
+int http_post_sync(
+        const char *url,
+        const char *auth,
+        const char *ctype,
+        const body_t *body,
+        uint32_t timeout_ms,
+        http_done_fn done,
+        void *ctx)
+{
+    char hdr[64];
+    body_cursor_t cur;
+    curl_ez_t *ez;
+    curl_ez_reply rep = null_curl_ez_reply;
+    http_result_t res;
+    curl_off_t retry_after = 0;
+    CURLSH *share;
+    uint64_t start;
+    CURLcode e;
+
+    assert_nonnull(url);
+    assert_nonnull(auth);
+    assert_nonnull(ctype);
+    assert_nonnull(body);
+    assert(timeout_ms != 0);
+    assert_nonnull(done);
+
+    ez = curl_ez_new();
+    if (ez == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    (void) snprintf(hdr, sizeof(hdr), "Content-Type: %s", ctype);
+    body_cursor_init(&cur, body);
+
+    /* Any thread may call, timeouts must not rely on SIGALRM */
+    (void) curl_ez_setopt(ez, CURLOPT_NOSIGNAL, 1L);
+    /* Reuse connection of the last synchronous request, a new one otherwise */
+    share = sync_share_get();
+    if (share != NULL) (void) curl_ez_setopt(ez, CURLOPT_SHARE, share);
+    if (curl_ez_set_timeouts(ez, (long) timeout_ms, (long) timeout_ms) != CURLE_OK ||
+            curl_ez_set_header(ez, auth) != CURLE_OK ||
+            curl_ez_set_header(ez, hdr) != CURLE_OK ||
+            curl_ez_post_stream_setup(ez, url, http_read_cb, http_seek_cb, &cur,
+                                (curl_off_t) body_size(body), CURL_EZ_FLAG_DISCARD_REPLY) != CURLE_OK) {
+        curl_ez_free(ez);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    PROBE3(http_entry, ez, url, body_size(body));
+    start = monotonic_ns();
+    e = curl_easy_perform(ez->curl);
+    PROBE2(http_return, ez, e);
+
+    if (e == CURLE_OK) {
+#if LIBCURL_VERSION_NUM >= 0x074200
+        (void) curl_easy_getinfo(ez->curl, CURLINFO_RETRY_AFTER, &retry_after);
+#endif
+        rep = curl_ez_post_reply(ez);
+    }
+
+    res.udata = NULL;
+    res.status = rep.status_code;
+    res.reply = rep.data;
+    res.error = e != CURLE_OK ? curl_easy_strerror(e) : NULL;
+    res.size = body_size(body);
+    res.retry_after = retry_after > 0 ? (uint32_t) retry_after : 0;
+    res.latency_ns = monotonic_ns() - start;
+    done(ctx, &res);
+
+    curl_ez_free(ez);
+    return 0;
+}
+
+static void http_complete(http_t *http, CURL *curl, CURLcode e, http_done_fn done, void *ctx)
+{
+    http_slot_t *slot = NULL;
+    curl_ez_reply rep = null_curl_ez_reply;
+    http_result_t res;
+    curl_off_t retry_after = 0;
+
+    (void) curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **) &slot);
+    assert_nonnull(slot);
+    assert(slot->busy);
+
+    (void) curl_multi_remove_handle(http->multi, curl);
+
+    if (slot->warmup) {
+        (void) curl_ez_setopt(slot->ez, CURLOPT_NOBODY, 0L);
+        slot->warmup = 0;
+        goto out_idle;
+    }
+
+    PROBE2(http_return, slot->ez, e);
+
+    if (e == CURLE_OK) {
+#if LIBCURL_VERSION_NUM >= 0x074200
+        /* Retry-After of 429/503(seconds), zero if absent */
+        (void) curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retry_after);
+#endif
+        rep = curl_ez_post_reply(slot->ez);
+    }
+
+    res.udata = slot->udata;
+    res.status = rep.status_code;
+    res.reply = rep.data;
+    res.error = e != CURLE_OK ? curl_easy_strerror(e) : NULL;
+    res.size = slot->size;
+    res.retry_after = retry_after > 0 ? (uint32_t) retry_after : 0;
+    res.latency_ns = monotonic_ns() - slot->start;
+    done(ctx, &res);
+
+    slot->udata = NULL;
+
+out_idle:
+    slot->busy = 0;
+    http->inflight--;
+}
+
+/**
+ * Drive transfers in flight and report completed ones via `done'
+ *
+ * @timeout_ms  Wait for socket activity or http_wakeup() at most, zero never waits
+ */
+void http_perform(http_t *http, uint32_t timeout_ms, http_done_fn done, void *ctx)
+{
+    CURLMsg *msg;
+    CURL *curl;
+    CURLcode e;
+    int n;
+
+    assert_nonnull(http);
+    assert_nonnull(done);
+
+    (void) curl_multi_perform(http->multi, &n);
+
+    if (timeout_ms != 0) {
+#ifdef HTTP_HAVE_MULTI_POLL
+        (void) curl_multi_poll(http->multi, NULL, 0, (int) timeout_ms, NULL);
+#else
+        (void) curl_multi_wait(http->multi, NULL, 0, (int) MIN(timeout_ms, HTTP_WAIT_MAX_MS), NULL);
+#endif
+        (void) curl_multi_perform(http->multi, &n);
+    }
+
+    while ((msg = curl_multi_info_read(http->multi, &n)) != NULL) {
+        if (msg->msg != CURLMSG_DONE) continue;
+        /* Message is gone once its handle removed */
+        curl = msg->easy_handle;
+        e = msg->data.result;
+        http_complete(http, curl, e, done, ctx);
+    }
+}
+
+/**
+ * Wake up http_perform() waiting in another thread
+ * Waits are bounded by HTTP_WAIT_MAX_MS instead with older libcurl
+ */
+void http_wakeup(http_t *http)
+{
+    assert_nonnull(http);
+#ifdef HTTP_HAVE_MULTI_POLL
+    (void) curl_multi_wakeup(http->multi);
+#endif
+}
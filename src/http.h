@@ -0,0 +1,52 @@
+/*
+ * Created 191101 lynnl
+ *
+ * Concurrent HTTP transport over curl_multi
+ * POSTs in flight are multiplexed over one HTTP/2 connection if the server
+ *  speaks it(HTTPS), otherwise each of them takes an HTTP/1.1 connection
+ * Driven by a single thread(the process-wide worker), only http_wakeup()
+ *  and http_post_sync() can be called from other threads
+ */
+
+#ifndef CSENTRY_HTTP_H
+#define CSENTRY_HTTP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "utils.h"
+#include "body.h"
+
+#define HTTP_CONCURRENCY_DEFAULT    8u
+#define HTTP_CONCURRENCY_MAX        64u
+#define HTTP_INFLIGHT_BYTES_DEFAULT (1u << 20u)
+#define HTTP_CONNECT_TIMEOUT_DEFAULT_MS 5000u
+#define HTTP_TIMEOUT_DEFAULT_MS     30000u
+
+/* Opaque: curl_ez.h can only be included by a single translation unit */
+typedef struct http http_t;
+
+typedef struct {
+    void * _nullable udata;     /* As passed to http_submit() */
+    int status;                 /* HTTP status code, -1 if request failed */
+    const char * _nullable reply;   /* Body of an error reply, 2xx ones are discarded */
+    const char * _nullable error;   /* cURL error if request failed */
+    size_t size;                /* Request body size */
+    uint32_t retry_after;       /* Retry-After in seconds, zero if absent */
+    uint64_t latency_ns;        /* Submitted to done */
+} http_result_t;
+
+typedef void (*http_done_fn)(void *, const http_result_t *);
+
+http_t * _nullable http_new(void);
+void http_free(http_t * _nullable);
+uint32_t http_inflight(const http_t *);
+int http_ready(const http_t *);
+int http_submit(http_t *, const char *, const char *, const char *, const body_t *, void * _nullable);
+int http_post_sync(const char *, const char *, const char *, const body_t *, uint32_t, http_done_fn, void *);
+void http_perform(http_t *, uint32_t, http_done_fn, void *);
+void http_wakeup(http_t *);
+void http_set_timeouts(http_t *, uint32_t, uint32_t);
+int http_preconnect(http_t *, const char *);
+
+#endif /* CSENTRY_HTTP_H */
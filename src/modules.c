@@ -0,0 +1,291 @@
+/*
+ * Created 191022 lynnl
+ */
+
+/* dl_iterate_phdr(3) is a GNU extension on glibc */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__DragonFly__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <link.h>
+#define HAVE_DL_ITERATE_PHDR    1
+#endif
+
+#include "symbolize.h"
+#include "modules.h"
+
+/*
+ * Module table is built once and cached
+ * It's rebuilt only if dl_iterate_phdr(3) reports any dlopen/dlclose since
+ */
+static struct {
+    pthread_mutex_t mtx;
+    module_t *mods;
+    uint32_t n;
+    unsigned long long adds;
+    unsigned long long subs;
+    int valid;
+} table = {
+    .mtx = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#ifdef HAVE_DL_ITERATE_PHDR
+
+#ifndef NT_GNU_BUILD_ID
+#define NT_GNU_BUILD_ID         3
+#endif
+
+#define NOTE_ALIGN(n)           (((n) + 3u) & ~3u)
+
+static void hex_encode(const uint8_t *p, size_t n, char *out)
+{
+    static const char hex[] = "0123456789abcdef";
+    while (n--) {
+        *out++ = hex[*p >> 4u];
+        *out++ = hex[*p++ & 0xfu];
+    }
+    *out = '\0';
+}
+
+/*
+ * Debug id is the first 16 bytes of build id as a little-endian GUID
+ * see: https://getsentry.github.io/symbolicator/advanced/symbol-lookup/#identifiers
+ */
+static void build_id_to_debug_id(const uint8_t *id, size_t n, uuid_string_t out)
+{
+    uint8_t b[16];
+    uuid_t uu;
+
+    /* Shorter build id is zero padded, so never read past its end */
+    (void) memset(b, 0, sizeof(b));
+    (void) memcpy(b, id, MIN(n, sizeof(b)));
+    (void) memcpy(uu, b, sizeof(uu));
+
+    uu[0] = b[3]; uu[1] = b[2]; uu[2] = b[1]; uu[3] = b[0];
+    uu[4] = b[5]; uu[5] = b[4];
+    uu[6] = b[7]; uu[7] = b[6];
+
+    uuid_unparse_lower(uu, out);
+}
+
+static void parse_build_id(struct dl_phdr_info *info, const ElfW(Phdr) *ph, module_t *mod)
+{
+    const uint8_t *p = (const uint8_t *) (info->dlpi_addr + ph->p_vaddr);
+    const uint8_t *end = p + ph->p_memsz;
+    const ElfW(Nhdr) *nh;
+    const uint8_t *desc;
+
+    while (p + sizeof(*nh) <= end) {
+        nh = (const ElfW(Nhdr) *) p;
+        desc = p + sizeof(*nh) + NOTE_ALIGN(nh->n_namesz);
+        if (desc + nh->n_descsz > end) break;
+
+        if (nh->n_type == NT_GNU_BUILD_ID && nh->n_namesz == 4 &&
+                !memcmp(p + sizeof(*nh), "GNU", 4) && nh->n_descsz != 0) {
+            hex_encode(desc, MIN(nh->n_descsz, (MODULE_CODE_ID_MAX - 1) / 2), mod->code_id);
+            build_id_to_debug_id(desc, nh->n_descsz, mod->debug_id);
+            return;
+        }
+
+        p = desc + NOTE_ALIGN(nh->n_descsz);
+    }
+}
+
+typedef struct {
+    module_t *mods;
+    uint32_t n;
+    uint32_t cap;
+} module_vec_t;
+
+static int collect_cb(struct dl_phdr_info *info, size_t size, void *data)
+{
+    module_vec_t *v = (module_vec_t *) data;
+    module_t *mod, *p;
+    uintptr_t lo = UINTPTR_MAX, hi = 0;
+    ElfW(Half) i;
+
+    UNUSED(size);
+
+    if (v->n == v->cap) {
+        v->cap = v->cap ? v->cap * 2 : 32;
+        p = (module_t *) realloc(v->mods, v->cap * sizeof(*p));
+        if (p == NULL) return -1;
+        v->mods = p;
+    }
+
+    mod = &v->mods[v->n];
+    (void) memset(mod, 0, sizeof(*mod));
+
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        if (ph->p_type == PT_LOAD) {
+            lo = MIN(lo, (uintptr_t) ph->p_vaddr);
+            if (ph->p_vaddr + ph->p_memsz > hi) hi = ph->p_vaddr + ph->p_memsz;
+        } else if (ph->p_type == PT_NOTE && mod->code_id[0] == '\0') {
+            parse_build_id(info, ph, mod);
+        }
+    }
+    if (lo >= hi) return 0;     /* No loadable segment */
+
+    mod->addr = info->dlpi_addr + lo;
+    mod->size = hi - lo;
+    if (info->dlpi_name != NULL && *info->dlpi_name != '\0') {
+        (void) snprintf(mod->path, sizeof(mod->path), "%s", info->dlpi_name);
+    } else if (v->n == 0) {
+        /* Main program always comes first with an empty name */
+#if defined(__linux__)
+        ssize_t n = readlink("/proc/self/exe", mod->path, sizeof(mod->path) - 1);
+        mod->path[n > 0 ? n : 0] = '\0';
+#endif
+    }
+
+    v->n++;
+    return 0;
+}
+
+typedef struct {
+    unsigned long long adds;
+    unsigned long long subs;
+} dl_counters_t;
+
+static int counters_cb(struct dl_phdr_info *info, size_t size, void *data)
+{
+    dl_counters_t *c = (dl_counters_t *) data;
+
+    /* dlpi_adds/dlpi_subs only presented in newer struct layout */
+    if (size < offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+        c->adds = c->subs = 0;
+    } else {
+        c->adds = info->dlpi_adds;
+        c->subs = info->dlpi_subs;
+    }
+    return 1;   /* Stop at first module */
+}
+
+#endif /* HAVE_DL_ITERATE_PHDR */
+
+/**
+ * Rebuild module table if any module got loaded or unloaded since last build
+ * Symbol cache is flushed as well, since addresses may be reused
+ *
+ * @return      0 if success  -1 o.w.
+ */
+int modules_refresh(void)
+{
+#ifdef HAVE_DL_ITERATE_PHDR
+    dl_counters_t c = {0, 0};
+    module_vec_t v = {NULL, 0, 0};
+    int e = 0;
+
+    (void) dl_iterate_phdr(counters_cb, &c);
+
+    pthread_mutex_lock_safe(&table.mtx);
+
+    /* Counters unavailable, we cannot tell changes, rebuild every time */
+    if (table.valid && (c.adds | c.subs) != 0 &&
+            c.adds == table.adds && c.subs == table.subs) {
+        goto out_unlock;
+    }
+
+    if (dl_iterate_phdr(collect_cb, &v) != 0) {
+        free(v.mods);
+        set_err_jmp(-1, unlock);
+    }
+
+    free(table.mods);
+    table.mods = v.mods;
+    table.n = v.n;
+    table.adds = c.adds;
+    table.subs = c.subs;
+
+    if (table.valid) symbol_cache_flush();
+    table.valid = 1;
+
+out_unlock:
+    pthread_mutex_unlock_safe(&table.mtx);
+    return e;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Find module contains given address
+ * @return      1 if found(copied into `out')  0 o.w.
+ */
+int modules_find(uintptr_t addr, module_t *out)
+{
+    uint32_t i;
+    int found = 0;
+
+    assert_nonnull(out);
+
+    pthread_mutex_lock_safe(&table.mtx);
+    for (i = 0; i < table.n; i++) {
+        if (addr - table.mods[i].addr < table.mods[i].size) {
+            *out = table.mods[i];
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock_safe(&table.mtx);
+
+    return found;
+}
+
+/**
+ * @return      Sentry debug image json array of all loaded modules
+ */
+cJSON * _nullable modules_to_json(void)
+{
+    cJSON *images;
+    cJSON *image;
+    uint32_t i;
+
+    images = cJSON_CreateArray();
+    if (images == NULL) return NULL;
+
+    pthread_mutex_lock_safe(&table.mtx);
+    for (i = 0; i < table.n; i++) {
+        image = module_to_json(&table.mods[i]);
+        if (image != NULL) cJSON_AddItemToArray(images, image);
+    }
+    pthread_mutex_unlock_safe(&table.mtx);
+
+    return images;
+}
+
+/**
+ * @return      Sentry debug image json
+ * see: https://develop.sentry.dev/sdk/event-payloads/debugmeta/
+ */
+cJSON * _nullable module_to_json(const module_t *mod)
+{
+    cJSON *json;
+    char buf[32];
+
+    assert_nonnull(mod);
+
+    json = cJSON_CreateObject();
+    if (json == NULL) return NULL;
+
+    (void) cJSON_AddStringToObject(json, "type", "elf");
+    (void) snprintf(buf, sizeof(buf), "%#lx", (unsigned long) mod->addr);
+    (void) cJSON_AddStringToObject(json, "image_addr", buf);
+    (void) cJSON_AddNumberToObject(json, "image_size", mod->size);
+    (void) cJSON_AddStringToObject(json, "code_file", mod->path);
+    if (mod->code_id[0] != '\0') {
+        (void) cJSON_AddStringToObject(json, "code_id", mod->code_id);
+        (void) cJSON_AddStringToObject(json, "debug_id", mod->debug_id);
+    }
+
+    return json;
+}
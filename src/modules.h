@@ -0,0 +1,31 @@
+/*
+ * Created 191022 lynnl
+ *
+ * Loaded module(shared object) table for debug_meta interface
+ */
+
+#ifndef CSENTRY_MODULES_H
+#define CSENTRY_MODULES_H
+
+#include <stdint.h>
+#include <cjson/cJSON.h>
+
+#include "utils.h"
+
+#define MODULE_PATH_MAX         256
+#define MODULE_CODE_ID_MAX      41      /* 20-byte build id in hex */
+
+typedef struct {
+    uintptr_t addr;                     /* Image load address */
+    uintptr_t size;
+    char path[MODULE_PATH_MAX];
+    char code_id[MODULE_CODE_ID_MAX];   /* Empty if no build id */
+    uuid_string_t debug_id;             /* Empty if no build id */
+} module_t;
+
+int modules_refresh(void);
+int modules_find(uintptr_t, module_t *);
+cJSON * _nullable module_to_json(const module_t *);
+cJSON * _nullable modules_to_json(void);
+
+#endif /* CSENTRY_MODULES_H */
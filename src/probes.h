@@ -0,0 +1,32 @@
+/*
+ * Created 191028 lynnl
+ *
+ * USDT(user-level statically defined tracing) probes of provider `csentry'
+ * A probe site is a single nop until a tracer attaches to it
+ *  so arguments should be values already at hand, never compute them
+ *
+ * List probes:     readelf -n <binary> | grep -A2 stapsdt
+ * see: tools/usdt for bpftrace scripts
+ */
+
+#ifndef CSENTRY_PROBES_H
+#define CSENTRY_PROBES_H
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE0(name)                    DTRACE_PROBE(csentry, name)
+#define PROBE1(name, a)                 DTRACE_PROBE1(csentry, name, a)
+#define PROBE2(name, a, b)              DTRACE_PROBE2(csentry, name, a, b)
+#define PROBE3(name, a, b, c)           DTRACE_PROBE3(csentry, name, a, b, c)
+#define PROBE4(name, a, b, c, d)        DTRACE_PROBE4(csentry, name, a, b, c, d)
+#else
+/* Compiled out, arguments are still referenced to keep -Wunused quiet */
+#define PROBE0(name)                    ((void) 0)
+#define PROBE1(name, a)                 ((void) (a))
+#define PROBE2(name, a, b)              ((void) (a), (void) (b))
+#define PROBE3(name, a, b, c)           ((void) (a), (void) (b), (void) (c))
+#define PROBE4(name, a, b, c, d)        ((void) (a), (void) (b), (void) (c), (void) (d))
+#endif
+
+#endif /* CSENTRY_PROBES_H */
@@ -0,0 +1,168 @@
+/*
+ * Created 191019 lynnl
+ */
+
+#include <string.h>
+
+#include "utils.h"
+#include "ratelimit.h"
+
+#define MICRO_PER_UNIT          1000000.0
+#define NANO_PER_SEC            1000000000.0
+
+void ratelimit_init(ratelimit_t *rl)
+{
+    assert_nonnull(rl);
+    (void) memset(rl, 0, sizeof(*rl));
+}
+
+/**
+ * Update limiter parameters at runtime(lock-free)
+ * @rate        Events per second allowed for each call site, zero to disable
+ * @burst       Events allowed in a burst(at least one)
+ */
+void ratelimit_set(ratelimit_t *rl, double rate, uint32_t burst)
+{
+    assert_nonnull(rl);
+    assert(rate >= 0.0);
+
+    if (burst == 0) burst = 1;
+    __atomic_store_n(&rl->burst, burst, __ATOMIC_RELAXED);
+    __atomic_store_n(&rl->rate, (uint64_t) (rate * MICRO_PER_UNIT), __ATOMIC_RELAXED);
+}
+
+/**
+ * Hand an idle slot over to another call site
+ * A slot is idle once its bucket refilled in full, its suppressed count is lost
+ *
+ * @return      1 if the slot belongs to the key  0 o.w.
+ */
+static int ratelimit_reclaim(
+        ratelimit_slot_t *slot,
+        uint64_t key,
+        uint64_t rate,
+        uint32_t burst,
+        uint64_t now)
+{
+    uint64_t cur;
+    int ok;
+
+    /* Busy slot isn't idle */
+    if (__atomic_test_and_set(&slot->lock, __ATOMIC_ACQUIRE)) return 0;
+
+    cur = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+    ok = cur == key;
+    if (!ok && slot->last_ns != 0 && now > slot->last_ns &&
+            slot->tokens + (now - slot->last_ns) / NANO_PER_SEC * (rate / MICRO_PER_UNIT) >= burst) {
+        ok = __atomic_compare_exchange_n(&slot->key, &cur, key, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+        if (ok) {
+            slot->last_ns = 0;
+            slot->suppressed = 0;
+        }
+    }
+
+    __atomic_clear(&slot->lock, __ATOMIC_RELEASE);
+
+    return ok;
+}
+
+static ratelimit_slot_t * _nullable ratelimit_slot(
+        ratelimit_t *rl,
+        uint64_t key,
+        uint64_t rate,
+        uint32_t burst,
+        uint64_t now)
+{
+    uint64_t cur;
+    uint32_t i, n;
+    ratelimit_slot_t *slot;
+
+    for (n = 0, i = key & (RATELIMIT_SLOTS - 1); n < RATELIMIT_SLOTS;
+            n++, i = (i + 1) & (RATELIMIT_SLOTS - 1)) {
+        slot = &rl->slots[i];
+
+        cur = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+        if (cur == key) return slot;
+
+        if (cur == 0) {
+            if (__atomic_compare_exchange_n(&slot->key, &cur, key, 0,
+                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || cur == key) {
+                return slot;
+            }
+        }
+    }
+
+    /* Table full, slots are taken over but never emptied so probe chains hold */
+    for (n = 0, i = key & (RATELIMIT_SLOTS - 1); n < RATELIMIT_SLOTS;
+            n++, i = (i + 1) & (RATELIMIT_SLOTS - 1)) {
+        slot = &rl->slots[i];
+        if (ratelimit_reclaim(slot, key, rate, burst, now)) return slot;
+    }
+
+    return NULL;
+}
+
+/**
+ * Take a token for a call site
+ *
+ * @key         Call site key(nonzero)
+ * @suppressed  [OUT] Count of events suppressed since the previous pass
+ *              Only valid if returns 1
+ * @return      1 if event may pass  0 if it should be suppressed
+ *
+ * Disabled limiter and table full of busy call sites fail open
+ */
+int ratelimit_acquire(ratelimit_t *rl, uint64_t key, uint32_t *suppressed)
+{
+    ratelimit_slot_t *slot;
+    uint64_t rate, now;
+    uint32_t burst;
+    int pass;
+
+    assert_nonnull(rl);
+    assert(key != 0);
+    assert_nonnull(suppressed);
+
+    *suppressed = 0;
+
+    rate = __atomic_load_n(&rl->rate, __ATOMIC_RELAXED);
+    if (rate == 0) return 1;
+    burst = __atomic_load_n(&rl->burst, __ATOMIC_RELAXED);
+
+    now = monotonic_ns();
+
+out_retry:
+    slot = ratelimit_slot(rl, key, rate, burst, now);
+    if (slot == NULL) return 1;
+
+    while (__atomic_test_and_set(&slot->lock, __ATOMIC_ACQUIRE)) continue;
+
+    /* Reclaimed by another call site meanwhile */
+    if (__atomic_load_n(&slot->key, __ATOMIC_ACQUIRE) != key) {
+        __atomic_clear(&slot->lock, __ATOMIC_RELEASE);
+        goto out_retry;
+    }
+
+    if (slot->last_ns == 0) {
+        /* Fresh slot starts with a full bucket */
+        slot->tokens = burst;
+    } else if (now > slot->last_ns) {
+        slot->tokens += (now - slot->last_ns) / NANO_PER_SEC * (rate / MICRO_PER_UNIT);
+        if (slot->tokens > burst) slot->tokens = burst;
+    }
+    slot->last_ns = now;
+
+    pass = slot->tokens >= 1.0;
+    if (pass) {
+        slot->tokens -= 1.0;
+        *suppressed = slot->suppressed;
+        slot->suppressed = 0;
+    } else {
+        slot->suppressed++;
+    }
+
+    __atomic_clear(&slot->lock, __ATOMIC_RELEASE);
+
+    return pass;
+}
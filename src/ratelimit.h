@@ -0,0 +1,38 @@
+/*
+ * Created 191019 lynnl
+ *
+ * Per-call-site token bucket rate limiter
+ */
+
+#ifndef CSENTRY_RATELIMIT_H
+#define CSENTRY_RATELIMIT_H
+
+#include <stdint.h>
+
+/* Must be power of 2 */
+#define RATELIMIT_SLOTS         256u
+
+typedef struct {
+    uint64_t key;           /* Call site key, zero if unclaimed */
+    uint8_t lock;           /* Protects fields below */
+    uint32_t suppressed;    /* Events suppressed since last pass */
+    double tokens;
+    uint64_t last_ns;       /* Last refill time */
+} ratelimit_slot_t;
+
+/*
+ * Fixed-size open addressing table, slots are claimed by CAS
+ *  once full, idle slots are taken over by new call sites
+ * Each slot guarded by its own spin lock, so call sites never contend each other
+ */
+typedef struct {
+    uint64_t rate;          /* Micro-tokens per second, zero means disabled */
+    uint32_t burst;         /* Bucket capacity in tokens */
+    ratelimit_slot_t slots[RATELIMIT_SLOTS];
+} ratelimit_t;
+
+void ratelimit_init(ratelimit_t *);
+void ratelimit_set(ratelimit_t *, double, uint32_t);
+int ratelimit_acquire(ratelimit_t *, uint64_t, uint32_t *);
+
+#endif /* CSENTRY_RATELIMIT_H */
@@ -0,0 +1,238 @@
+/*
+ * Created 191030 lynnl
+ *
+ * Writes never block for longer than RELAY_SEND_TIMEOUT_MS
+ * Events in flight are bounded by the socket send buffer, beyond that
+ *  they stay in the client queue(EVENT_QUEUE_MAX)
+ * Only a relay run by the same user(or root) is talked to
+ */
+
+/* struct ucred is a GNU extension on glibc */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "relay.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL            0       /* SO_NOSIGPIPE set instead */
+#endif
+
+/**
+ * Default relay socket, in the per-user runtime directory
+ * @return      0 if success  -1 o.w.(errno will be set)
+ */
+int relay_default_path(char *buf, size_t size)
+{
+    char dir[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    int n;
+
+    assert_nonnull(buf);
+
+    if (private_dir(NULL, dir, sizeof(dir)) != 0) return -1;
+
+    n = snprintf(buf, size, "%s/%s", dir, RELAY_DEFAULT_NAME);
+    if (n < 0 || (size_t) n >= size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @return      1 if peer of a connected socket runs as us(or root)  0 o.w.
+ */
+int relay_peer_trusted(int fd)
+{
+#if defined(SO_PEERCRED)
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) return 0;
+    return cred.uid == getuid() || cred.uid == 0;
+#else
+    uid_t uid;
+    gid_t gid;
+
+    if (getpeereid(fd, &uid, &gid) != 0) return 0;
+    return uid == getuid() || uid == 0;
+#endif
+}
+
+/**
+ * @path        Path of relay socket
+ * @return      Relay(connected lazily)  NULL o.w.(errno will be set)
+ */
+relay_t * _nullable relay_new(const char *path)
+{
+    relay_t *relay;
+
+    assert_nonnull(path);
+
+    if (strlen(path) >= sizeof(relay->path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    relay = (relay_t *) malloc(sizeof(*relay));
+    if (relay != NULL) {
+        relay->fd = -1;
+        relay->retry_at = 0;
+        (void) strcpy(relay->path, path);
+    }
+
+    return relay;
+}
+
+static void relay_disconnect(relay_t *relay)
+{
+    if (relay->fd >= 0) {
+        (void) close(relay->fd);
+        relay->fd = -1;
+    }
+    relay->retry_at = monotonic_ns() + RELAY_RETRY_MS * 1000000ull;
+}
+
+void relay_free(relay_t * _nullable relay)
+{
+    if (relay != NULL) {
+        if (relay->fd >= 0) (void) close(relay->fd);
+        free(relay);
+    }
+}
+
+/**
+ * Connect to relay if not yet, attempts are throttled by RELAY_RETRY_MS
+ * @return      0 if success  -1 o.w.(errno will be set)
+ */
+static int relay_connect(relay_t *relay)
+{
+    struct sockaddr_un sun;
+    int sndbuf = RELAY_MSG_MAX;
+    int fd;
+
+    if (relay->fd >= 0) return 0;
+
+    if (monotonic_ns() < relay->retry_at) {
+        errno = ECONNREFUSED;
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0) goto out_fail;
+
+    (void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+    (void) setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+#ifdef SO_NOSIGPIPE
+    {
+        int on = 1;
+        (void) setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    }
+#endif
+
+    (void) memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    (void) strcpy(sun.sun_path, relay->path);
+    if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) != 0) goto out_fail;
+
+    /* Events carry DSN keys, never hand them to a socket planted by others */
+    if (!relay_peer_trusted(fd)) {
+        errno = EPERM;
+        goto out_fail;
+    }
+
+    /* Blocking connect(2) is instant for UNIX sockets, only writes need to be non-blocking */
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0) goto out_fail;
+
+    relay->fd = fd;
+    return 0;
+
+out_fail:
+    if (fd >= 0) {
+        int e = errno;
+        (void) close(fd);
+        errno = e;
+    }
+    relay->retry_at = monotonic_ns() + RELAY_RETRY_MS * 1000000ull;
+    return -1;
+}
+
+/**
+ * Ship an event to relay
+ *
+ * @url         Store URL the relay POSTs to
+ * @auth        X-Sentry-Auth header line
+ * @return      0 if the relay got it  -1 o.w.(errno will be set)
+ *              ETIMEDOUT if relay fell behind  EMSGSIZE if event too large
+ */
+int relay_send(relay_t *relay, const char *url, const char *auth, const char *body, size_t size)
+{
+    relay_hdr_t hdr;
+    struct iovec iov[4];
+    struct msghdr msg;
+    struct pollfd pfd;
+    int n;
+
+    assert_nonnull(relay);
+    assert_nonnull(url);
+    assert_nonnull(auth);
+    assert_nonnull(body);
+
+    hdr.magic = RELAY_MAGIC;
+    hdr.url_len = (uint32_t) strlen(url);
+    hdr.auth_len = (uint32_t) strlen(auth);
+    hdr.body_len = (uint32_t) size;
+    if (sizeof(hdr) + hdr.url_len + hdr.auth_len + size > RELAY_MSG_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (relay_connect(relay) != 0) return -1;
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = (void *) url;
+    iov[1].iov_len = hdr.url_len;
+    iov[2].iov_base = (void *) auth;
+    iov[2].iov_len = hdr.auth_len;
+    iov[3].iov_base = (void *) body;
+    iov[3].iov_len = size;
+
+    (void) memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = ARRAY_SIZE(iov);
+
+    for (;;) {
+        /* A SOCK_SEQPACKET message is sent as a whole or not at all */
+        if (sendmsg(relay->fd, &msg, MSG_NOSIGNAL) >= 0) return 0;
+
+        if (errno == EINTR) continue;
+        if (errno == EMSGSIZE) return -1;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) break;
+
+        pfd.fd = relay->fd;
+        pfd.events = POLLOUT;
+        n = poll(&pfd, 1, RELAY_SEND_TIMEOUT_MS);
+        if (n == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (n < 0 && errno != EINTR) break;
+    }
+
+    /* Relay gone(EPIPE, ECONNRESET, ...) */
+    n = errno;
+    relay_disconnect(relay);
+    errno = n;
+    return -1;
+}
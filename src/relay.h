@@ -0,0 +1,48 @@
+/*
+ * Created 191030 lynnl
+ *
+ * Local relay transport: events are shipped over a UNIX domain socket
+ *  to a relay daemon(see tools/relay.c) which forwards them over HTTP
+ */
+
+#ifndef CSENTRY_RELAY_H
+#define CSENTRY_RELAY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/un.h>
+
+#include "utils.h"
+
+#define RELAY_DEFAULT_NAME      "relay.sock"    /* Under private_dir() */
+#define RELAY_AUTH_PREFIX       "X-Sentry-Auth:"
+#define RELAY_MAGIC             0x63737279u     /* "csry" */
+#define RELAY_MSG_MAX           (1u << 20u)     /* SO_SNDBUF/SO_RCVBUF */
+#define RELAY_SEND_TIMEOUT_MS   1000u
+#define RELAY_RETRY_MS          1000u           /* Reconnect backoff */
+
+/*
+ * One SOCK_SEQPACKET message per event:
+ *  relay_hdr_t, store URL, X-Sentry-Auth header line, body
+ * Strings aren't NUL-terminated
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t url_len;
+    uint32_t auth_len;
+    uint32_t body_len;
+} relay_hdr_t;
+
+typedef struct {
+    int fd;                     /* -1 if not connected */
+    uint64_t retry_at;          /* Monotonic ns of next connect attempt */
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+} relay_t;
+
+int relay_default_path(char *, size_t);
+int relay_peer_trusted(int);
+relay_t * _nullable relay_new(const char *);
+void relay_free(relay_t * _nullable);
+int relay_send(relay_t *, const char *, const char *, const char *, size_t);
+
+#endif /* CSENTRY_RELAY_H */
@@ -0,0 +1,421 @@
+/*
+ * Created 191029 lynnl
+ *
+ * Record layout: shmring_rec_t header followed by payload, aligned to the header
+ *  so padding at the end of data area always has room for one
+ * A producer claims the record at head by CAS on its claim word, which
+ *  packs extent and producer of it, then advances head past it
+ *  producers finding a claimed record at head advance head on its behalf
+ * Then it copies payload and commits the record by storing its state(release)
+ * The uploader zeroes every byte it consumes before advancing tail,
+ *  so a reserved but not yet committed record always reads as SHMREC_EMPTY
+ *
+ * A record which can't fit into the end of data area is preceded by
+ *  a padding record, which fills the rest of it
+ *
+ * A producer died after its claim leaves a stalled record, whose extent is
+ *  known all along, it's skipped after SHMRING_STALL_MS if its producer is
+ *  gone, a slow producer is waited for however long it takes
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shmring.h"
+
+#define SHMREC_EMPTY            0u
+#define SHMREC_COMMITTED        1u
+#define SHMREC_PADDING          2u
+
+#define SHMRING_ALIGN(n)        (((n) + 31u) & ~(uint64_t) 31u)
+
+#define SHMRING_INIT_MS         1000u   /* Creator initializing the ring */
+#define SHMRING_STALL_MS        2000u
+
+/*
+ * Claim word: lap | pid | extent(in 8-byte units)
+ * Pids are within PID_MAX_LIMIT of Linux, zero if not so(never deemed gone)
+ * Lap of the record position tells a claim from a stale one, made by
+ *  a producer preempted while the ring went round
+ */
+#define CLAIM_EXTENT_BITS       28u
+#define CLAIM_PID_BITS          22u
+#define CLAIM_LAP_MASK          ((1ull << (64u - CLAIM_PID_BITS - CLAIM_EXTENT_BITS)) - 1u)
+
+#define CLAIM_EXTENT(c)         (((c) & ((1ull << CLAIM_EXTENT_BITS) - 1u)) << 3u)
+#define CLAIM_PID(c)            ((pid_t) (((c) >> CLAIM_EXTENT_BITS) & ((1ull << CLAIM_PID_BITS) - 1u)))
+#define CLAIM_LAP(c)            ((c) >> (CLAIM_PID_BITS + CLAIM_EXTENT_BITS))
+
+typedef struct {
+    uint64_t claim;             /* Stored first, see shmring_claim() */
+    uint32_t len;               /* Payload bytes */
+    uint32_t state;
+    uint32_t prio;              /* Opaque to the ring */
+    uint32_t reserved[3];
+} shmring_rec_t;
+
+static int is_pow2(uint32_t n)
+{
+    return n != 0 && (n & (n - 1)) == 0;
+}
+
+/**
+ * Wait for the creator to size and initialize the ring
+ * @return      0 if success  -1 o.w.(errno will be set)
+ */
+static int shmring_wait_init(shmring_t *ring)
+{
+    struct timespec ts = {0, 1000000};      /* 1ms */
+    struct stat st;
+    uint64_t deadline = monotonic_ns() + SHMRING_INIT_MS * 1000000ull;
+
+    for (;;) {
+        if (fstat(ring->fd, &st) != 0) return -1;
+        if ((size_t) st.st_size >= sizeof(shmring_hdr_t)) break;
+        if (monotonic_ns() >= deadline) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        (void) nanosleep(&ts, NULL);
+    }
+
+    ring->map_size = (size_t) st.st_size;
+    ring->hdr = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+    if (ring->hdr == MAP_FAILED) {
+        ring->hdr = NULL;
+        return -1;
+    }
+
+    while (__atomic_load_n(&ring->hdr->magic, __ATOMIC_ACQUIRE) != SHMRING_MAGIC) {
+        if (monotonic_ns() >= deadline) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        (void) nanosleep(&ts, NULL);
+    }
+
+    /* Created by another build(or corrupted) */
+    if (!is_pow2(ring->hdr->size) ||
+            sizeof(shmring_hdr_t) + ring->hdr->size != ring->map_size) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Open a ring by name, create it if absent
+ *
+ * @name        POSIX shared memory object name, e.g. "/csentry-xxx"
+ * @size        Data area size(power of 2), ignored if the ring exists
+ * @return      Ring  NULL o.w.(errno will be set)
+ */
+shmring_t * _nullable shmring_open(const char *name, uint32_t size)
+{
+    int e;
+    shmring_t *ring;
+
+    assert_nonnull(name);
+
+    if (!is_pow2(size)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ring = (shmring_t *) malloc(sizeof(*ring));
+    if (ring == NULL) return NULL;
+    (void) memset(ring, 0, sizeof(*ring));
+
+    ring->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (ring->fd >= 0) {
+        ring->map_size = sizeof(shmring_hdr_t) + size;
+        if (ftruncate(ring->fd, (off_t) ring->map_size) != 0) set_err_jmp(-1, unlink);
+
+        ring->hdr = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+        if (ring->hdr == MAP_FAILED) {
+            ring->hdr = NULL;
+            set_err_jmp(-1, unlink);
+        }
+
+        /* ftruncate(2) zero-filled the rest */
+        ring->hdr->size = size;
+        __atomic_store_n(&ring->hdr->magic, SHMRING_MAGIC, __ATOMIC_RELEASE);
+    } else if (errno == EEXIST) {
+        ring->fd = shm_open(name, O_RDWR, 0);
+        if (ring->fd < 0) set_err_jmp(-1, free);
+        if (shmring_wait_init(ring) != 0) set_err_jmp(-1, close);
+    } else {
+        set_err_jmp(-1, free);
+    }
+
+    ring->data = (char *) (ring->hdr + 1);
+
+out_exit:
+    return ring;
+
+out_unlink:
+    e = errno;
+    (void) shm_unlink(name);
+    errno = e;
+out_close:
+    e = errno;
+    if (ring->hdr != NULL) (void) munmap(ring->hdr, ring->map_size);
+    (void) close(ring->fd);
+    errno = e;
+out_free:
+    free(ring);
+    ring = NULL;
+    goto out_exit;
+}
+
+/**
+ * Unmap the ring, the shared memory object is kept for other processes
+ * The uploader lock is released along with the descriptor
+ */
+void shmring_close(shmring_t * _nullable ring)
+{
+    if (ring != NULL) {
+        (void) munmap(ring->hdr, ring->map_size);
+        (void) close(ring->fd);
+        free(ring);
+    }
+}
+
+static uint64_t shmring_lap(const shmring_t *ring, uint64_t pos)
+{
+    return (pos / ring->hdr->size) & CLAIM_LAP_MASK;
+}
+
+/**
+ * @return      Claim word of a record at `pos'
+ */
+static uint64_t shmring_claim(const shmring_t *ring, uint64_t pos, uint64_t extent, pid_t pid)
+{
+    uint64_t p = pid > 0 && (uint64_t) pid < (1ull << CLAIM_PID_BITS) ? (uint64_t) pid : 0;
+    return shmring_lap(ring, pos) << (CLAIM_PID_BITS + CLAIM_EXTENT_BITS) |
+            p << CLAIM_EXTENT_BITS | extent >> 3u;
+}
+
+/**
+ * @return      Extent of a record claimed at `pos'  0 if unclaimed(or a stale claim)
+ */
+static uint64_t shmring_extent(const shmring_t *ring, uint64_t pos, uint64_t claim)
+{
+    return claim != 0 && CLAIM_LAP(claim) == shmring_lap(ring, pos) ? CLAIM_EXTENT(claim) : 0;
+}
+
+/**
+ * Advance head on behalf of the producer which claimed the record at it
+ * A stale claim at head is cleared, its claimer may be gone before it does
+ */
+static void shmring_help(shmring_t *ring, uint64_t head, shmring_rec_t *rec)
+{
+    uint64_t claim = __atomic_load_n(&rec->claim, __ATOMIC_SEQ_CST);
+    uint64_t extent = shmring_extent(ring, head, claim);
+
+    if (extent != 0) {
+        (void) __atomic_compare_exchange_n(&ring->hdr->head, &head, head + extent,
+                    0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    } else if (claim != 0 && __atomic_load_n(&ring->hdr->head, __ATOMIC_SEQ_CST) == head) {
+        /* Head never moves past a stale claim, nor is it replaced by a valid one */
+        (void) __atomic_compare_exchange_n(&rec->claim, &claim, 0,
+                    0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * Push a record, never blocks
+ * @prio        Opaque to the ring, returned along with the record
+ * @return      0 if success  -1 o.w.(errno will be set)
+ *              ENOSPC if ring full  EMSGSIZE if record too large
+ */
+int shmring_push(shmring_t *ring, const void *buf, uint32_t len, uint32_t prio)
+{
+    uint32_t size;
+    uint64_t need, pad, pos, head, tail, off, extent, claim, cur;
+    pid_t pid = getpid();
+    shmring_rec_t *rec;
+
+    assert_nonnull(ring);
+    assert_nonnull(buf);
+
+    size = ring->hdr->size;
+    need = SHMRING_ALIGN(sizeof(*rec) + (uint64_t) len);
+    /* Keep room for records of other producers */
+    if (need > size / 4) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    for (;;) {
+        pos = __atomic_load_n(&ring->hdr->head, __ATOMIC_SEQ_CST);
+        tail = __atomic_load_n(&ring->hdr->tail, __ATOMIC_SEQ_CST);
+        off = pos & (size - 1);
+        pad = off + need > size ? size - off : 0;
+        if (pos + pad + need - tail > size) {
+            (void) __atomic_add_fetch(&ring->hdr->dropped, 1, __ATOMIC_RELAXED);
+            errno = ENOSPC;
+            return -1;
+        }
+
+        /* Padding claimed first, the record itself in next round */
+        extent = pad != 0 ? pad : need;
+        rec = (shmring_rec_t *) (ring->data + off);
+        claim = shmring_claim(ring, pos, extent, pid);
+        cur = 0;
+        if (!__atomic_compare_exchange_n(&rec->claim, &cur, claim,
+                    0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            /* Claimed by another producer, which may be gone already */
+            shmring_help(ring, pos, rec);
+            continue;
+        }
+
+        head = pos;
+        if (!__atomic_compare_exchange_n(&ring->hdr->head, &head, pos + extent,
+                    0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            /*
+             * Either advanced on our behalf, or the record at `pos' was consumed
+             *  before our claim, which is stale then
+             * Tail never moves past a live producer's uncommitted record
+             */
+            if (__atomic_load_n(&ring->hdr->tail, __ATOMIC_SEQ_CST) > pos) {
+                (void) __atomic_compare_exchange_n(&rec->claim, &claim, 0,
+                            0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+                continue;
+            }
+        }
+
+        if (pad == 0) break;
+        __atomic_store_n(&rec->state, SHMREC_PADDING, __ATOMIC_RELEASE);
+    }
+
+    rec->len = len;
+    rec->prio = prio;
+    (void) memcpy(rec + 1, buf, len);
+    __atomic_store_n(&rec->state, SHMREC_COMMITTED, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/**
+ * Try to become the uploader of the ring(non-blocking)
+ * The lock is held until shmring_close() or the process exits
+ *
+ * @return      0 if success  -1 o.w.(errno will be set)
+ *              EWOULDBLOCK if another process is the uploader
+ */
+int shmring_lock(shmring_t *ring)
+{
+    assert_nonnull(ring);
+
+    if (!ring->uploader) {
+        if (flock(ring->fd, LOCK_EX | LOCK_NB) != 0) return -1;
+        ring->uploader = 1;
+    }
+    return 0;
+}
+
+/**
+ * @return      1 if producer of a stalled record is known to be gone  0 o.w.
+ */
+static int shmring_producer_gone(uint64_t claim)
+{
+    pid_t pid = CLAIM_PID(claim);
+    return pid > 0 && kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+/**
+ * Release `n' bytes at tail(uploader only)
+ */
+static void shmring_consume(shmring_t *ring, uint64_t tail, uint64_t n)
+{
+    (void) memset(ring->data + (tail & (ring->hdr->size - 1)), 0, n);
+    __atomic_store_n(&ring->hdr->tail, tail + n, __ATOMIC_RELEASE);
+}
+
+/**
+ * Pop a record(uploader only)
+ *
+ * @len         [out] Payload bytes
+ * @prio        [out] Passed to shmring_push()
+ * @return      Payload(free(3) after use, NUL-terminated)
+ *              NULL o.w.(errno will be set)  EAGAIN if nothing to pop
+ */
+char * _nullable shmring_pop(shmring_t *ring, uint32_t *len, uint32_t *prio)
+{
+    uint32_t size, state;
+    uint64_t tail, head, off, n, now, claim;
+    shmring_rec_t *rec;
+    char *buf;
+
+    assert_nonnull(ring);
+    assert_nonnull(len);
+    assert_nonnull(prio);
+    assert(ring->uploader);
+
+    size = ring->hdr->size;
+
+    for (;;) {
+        tail = __atomic_load_n(&ring->hdr->tail, __ATOMIC_RELAXED);
+        head = __atomic_load_n(&ring->hdr->head, __ATOMIC_ACQUIRE);
+        if (tail == head) break;
+
+        off = tail & (size - 1);
+        rec = (shmring_rec_t *) (ring->data + off);
+        /* Head is advanced only past a claimed record */
+        claim = __atomic_load_n(&rec->claim, __ATOMIC_ACQUIRE);
+        n = shmring_extent(ring, tail, claim);
+
+        /* Corrupted record, nothing we can do but skip to the end of data area */
+        if (n == 0 || off + n > size) {
+            shmring_consume(ring, tail, MIN(size - off, head - tail));
+            continue;
+        }
+
+        state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+        if (state == SHMREC_EMPTY) {
+            now = monotonic_ns();
+            if (ring->stall_pos != tail || ring->stall_since == 0) {
+                ring->stall_pos = tail;
+                ring->stall_since = now;
+                break;
+            }
+            if (now - ring->stall_since < SHMRING_STALL_MS * 1000000ull) break;
+            /* Still alive(or not ours to signal), it's just slow */
+            if (!shmring_producer_gone(claim)) break;
+            shmring_consume(ring, tail, n);
+            ring->stall_since = 0;
+            continue;
+        }
+
+        if (state == SHMREC_COMMITTED) {
+            if (sizeof(*rec) + (uint64_t) rec->len > n) {
+                shmring_consume(ring, tail, n);
+                continue;
+            }
+            buf = (char *) malloc(rec->len + 1);
+            if (buf == NULL) return NULL;
+            (void) memcpy(buf, rec + 1, rec->len);
+            buf[rec->len] = '\0';
+            *len = rec->len;
+            *prio = rec->prio;
+            shmring_consume(ring, tail, n);
+            return buf;
+        }
+
+        shmring_consume(ring, tail, n);
+    }
+
+    errno = EAGAIN;
+    return NULL;
+}
@@ -0,0 +1,54 @@
+/*
+ * Created 191029 lynnl
+ *
+ * Multi-process event ring in POSIX shared memory
+ * Any number of producers(processes) push serialized events lock-free
+ *  a single uploader, elected by flock(2), drains the ring
+ */
+
+#ifndef CSENTRY_SHMRING_H
+#define CSENTRY_SHMRING_H
+
+#include <stdint.h>
+
+#include "utils.h"
+
+#define SHMRING_MAGIC           0x63737233u     /* "csr3" */
+#define SHMRING_DEFAULT_SIZE    (4u << 20u)     /* Must be power of 2 */
+#define SHMRING_NAME_MAX        64
+
+/*
+ * Shared header, followed by the data area
+ * Positions are free-running, masked by size upon access
+ */
+typedef struct {
+    uint32_t magic;             /* Stored last upon creation */
+    uint32_t size;              /* Data area bytes */
+    uint64_t dropped;           /* Records dropped as ring full */
+    char pad0[48];
+    uint64_t head;              /* Next byte to reserve, producers CAS */
+    char pad1[56];
+    uint64_t tail;              /* Next byte to consume, uploader only */
+    char pad2[56];
+} shmring_hdr_t;
+
+typedef struct {
+    int fd;
+    size_t map_size;
+    shmring_hdr_t *hdr;
+    char *data;
+    int uploader;               /* Holds the uploader lock */
+
+    /* Uncommitted record at tail, see shmring_pop() */
+    uint64_t stall_pos;
+    uint64_t stall_since;
+} shmring_t;
+
+shmring_t * _nullable shmring_open(const char *, uint32_t);
+void shmring_close(shmring_t * _nullable);
+
+int shmring_push(shmring_t *, const void *, uint32_t, uint32_t);
+int shmring_lock(shmring_t *);
+char * _nullable shmring_pop(shmring_t *, uint32_t *, uint32_t *);
+
+#endif /* CSENTRY_SHMRING_H */
@@ -0,0 +1,208 @@
+/*
+ * Created 191027 lynnl
+ *
+ * Writers only touch the shard of the calling thread with relaxed atomics,
+ *  readers sum up all shards, so a snapshot isn't atomic as a whole
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "stats.h"
+
+/* Shard of the calling thread, zero if not yet assigned */
+static __thread uint32_t stats_shard = 0;
+static uint32_t stats_shard_next = 0;
+
+static stats_shard_t *shard_get(stats_t *st)
+{
+    if (stats_shard == 0) {
+        stats_shard = __atomic_fetch_add(&stats_shard_next, 1, __ATOMIC_RELAXED) % STATS_SHARDS + 1;
+    }
+    return &st->shards[stats_shard - 1];
+}
+
+/**
+ * @return      Stats with all counters zeroed  NULL if ENOMEM
+ */
+stats_t * _nullable stats_new(void)
+{
+    void *p;
+
+    /* malloc(3) doesn't guarantee cache line alignment */
+    if (posix_memalign(&p, 64, sizeof(stats_t)) != 0) return NULL;
+    (void) memset(p, 0, sizeof(stats_t));
+    return (stats_t *) p;
+}
+
+void stats_free(stats_t * _nullable st)
+{
+    free(st);
+}
+
+void stats_add(stats_t *st, stat_counter_t c, uint64_t n)
+{
+    assert_nonnull(st);
+    assert(c < STAT_COUNTER_MAX);
+    (void) __atomic_add_fetch(&shard_get(st)->counters[c], n, __ATOMIC_RELAXED);
+}
+
+/**
+ * @return      Histogram bucket of a latency, see CSENTRY_STATS_BUCKETS
+ */
+static uint32_t latency_bucket(uint64_t ns)
+{
+    uint64_t us = (ns + 999) / 1000;
+    uint32_t i;
+
+    if (us <= 1) return 0;
+    i = 64 - __builtin_clzll(us - 1);   /* ceil(log2(us)) */
+    return MIN(i, CSENTRY_STATS_BUCKETS - 1);
+}
+
+void stats_observe(stats_t *st, stat_latency_t l, uint64_t ns)
+{
+    stats_shard_t *shard;
+
+    assert_nonnull(st);
+    assert(l < STAT_LATENCY_MAX);
+
+    shard = shard_get(st);
+    (void) __atomic_add_fetch(&shard->buckets[l][latency_bucket(ns)], 1, __ATOMIC_RELAXED);
+    (void) __atomic_add_fetch(&shard->sum_ns[l], ns, __ATOMIC_RELAXED);
+}
+
+static void histogram_collect(const stats_t *st, stat_latency_t l, csentry_histogram_t *h)
+{
+    uint32_t i, j;
+    uint64_t n;
+
+    (void) memset(h, 0, sizeof(*h));
+    for (i = 0; i < STATS_SHARDS; i++) {
+        for (j = 0; j < CSENTRY_STATS_BUCKETS; j++) {
+            n = __atomic_load_n(&st->shards[i].buckets[l][j], __ATOMIC_RELAXED);
+            h->buckets[j] += n;
+            h->count += n;
+        }
+        h->sum_ns += __atomic_load_n(&st->shards[i].sum_ns[l], __ATOMIC_RELAXED);
+    }
+}
+
+void stats_collect(const stats_t *st, csentry_stats_t *out)
+{
+    uint64_t c[STAT_COUNTER_MAX];
+    uint32_t i, j;
+
+    assert_nonnull(st);
+    assert_nonnull(out);
+
+    (void) memset(c, 0, sizeof(c));
+    for (i = 0; i < STATS_SHARDS; i++) {
+        for (j = 0; j < STAT_COUNTER_MAX; j++) {
+            c[j] += __atomic_load_n(&st->shards[i].counters[j], __ATOMIC_RELAXED);
+        }
+    }
+
+    out->captured = c[STAT_CAPTURED];
+    out->sampled_out = c[STAT_SAMPLED_OUT];
+    out->disabled_dropped = c[STAT_DISABLED_DROPPED];
+    out->rate_limited = c[STAT_RATE_LIMITED];
+    out->coalesced = c[STAT_COALESCED];
+    out->queue_dropped = c[STAT_QUEUE_DROPPED];
+    out->oversized_dropped = c[STAT_OVERSIZED_DROPPED];
+    out->sent = c[STAT_SENT];
+    out->failed = c[STAT_FAILED];
+    out->retried = c[STAT_RETRIED];
+    out->bytes_sent = c[STAT_BYTES_SENT];
+
+    histogram_collect(st, STAT_LATENCY_CAPTURE, &out->capture_latency);
+    histogram_collect(st, STAT_LATENCY_SERIALIZE, &out->serialize_latency);
+    histogram_collect(st, STAT_LATENCY_HTTP, &out->http_latency);
+}
+
+static void prom_counter(FILE *fp, const char *name, const char *help, uint64_t v)
+{
+    (void) fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                    name, help, name, name, (unsigned long long) v);
+}
+
+static void prom_gauge(FILE *fp, const char *name, const char *help, uint64_t v)
+{
+    (void) fprintf(fp, "# HELP %s %s\n# TYPE %s gauge\n%s %llu\n",
+                    name, help, name, name, (unsigned long long) v);
+}
+
+static void prom_histogram(FILE *fp, const char *name, const char *help, const csentry_histogram_t *h)
+{
+    uint64_t cum = 0;
+    uint32_t i;
+
+    (void) fprintf(fp, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (i = 0; i < CSENTRY_STATS_BUCKETS - 1; i++) {
+        cum += h->buckets[i];
+        (void) fprintf(fp, "%s_bucket{le=\"%g\"} %llu\n",
+                        name, (double) (1ull << i) / 1e6, (unsigned long long) cum);
+    }
+    (void) fprintf(fp, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n",
+                    name, (unsigned long long) h->count,
+                    name, (double) h->sum_ns / 1e9,
+                    name, (unsigned long long) h->count);
+}
+
+/**
+ * Write stats in Prometheus text exposition format
+ * The file is replaced atomically(rename(2)), suitable for textfile collectors
+ *
+ * @return      0 if success  -1 o.w.(errno will be set)
+ */
+int stats_write_prometheus(const csentry_stats_t *s, const char *path)
+{
+    int e = 0;
+    char tmp[PATH_MAX];
+    FILE *fp;
+
+    assert_nonnull(s);
+    assert_nonnull(path);
+
+    if (snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int) getpid()) >= (int) sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    fp = fopen(tmp, "w");
+    if (fp == NULL) return -1;
+
+    prom_counter(fp, "csentry_events_captured_total", "Events queued for POST", s->captured);
+    prom_counter(fp, "csentry_events_sampled_out_total", "Events dropped by sampling", s->sampled_out);
+    prom_counter(fp, "csentry_events_disabled_dropped_total", "Events dropped while disabled", s->disabled_dropped);
+    prom_counter(fp, "csentry_events_rate_limited_total", "Events dropped by rate limit", s->rate_limited);
+    prom_counter(fp, "csentry_events_coalesced_total", "Occurrences merged into queued events", s->coalesced);
+    prom_counter(fp, "csentry_events_queue_dropped_total", "Events dropped by full queue", s->queue_dropped);
+    prom_counter(fp, "csentry_events_oversized_dropped_total", "Events exceeded UDP datagram size", s->oversized_dropped);
+    prom_counter(fp, "csentry_events_sent_total", "Events accepted by Sentry server", s->sent);
+    prom_counter(fp, "csentry_events_failed_total", "Events failed to send", s->failed);
+    prom_counter(fp, "csentry_events_retried_total", "Spooled events sent again", s->retried);
+    prom_counter(fp, "csentry_bytes_sent_total", "Request body bytes sent", s->bytes_sent);
+    prom_gauge(fp, "csentry_http_inflight_bytes", "Request body bytes in flight", s->http_inflight_bytes);
+
+    prom_histogram(fp, "csentry_capture_latency_seconds", "Capture call to queued", &s->capture_latency);
+    prom_histogram(fp, "csentry_serialize_latency_seconds", "Event serialization", &s->serialize_latency);
+    prom_histogram(fp, "csentry_http_latency_seconds", "HTTP round-trip", &s->http_latency);
+
+    if (fclose(fp) != 0) set_err_jmp(-1, unlink);
+    if (rename(tmp, path) != 0) set_err_jmp(-1, unlink);
+
+out_exit:
+    return e;
+
+out_unlink:
+    e = errno;
+    (void) unlink(tmp);
+    errno = e;
+    e = -1;
+    goto out_exit;
+}
@@ -0,0 +1,58 @@
+/*
+ * Created 191027 lynnl
+ *
+ * Pipeline counters and latency histograms
+ */
+
+#ifndef CSENTRY_STATS_H
+#define CSENTRY_STATS_H
+
+#include <stdint.h>
+
+#include "utils.h"
+#include "csentry.h"
+
+#define STATS_SHARDS            16u
+
+typedef enum {
+    STAT_CAPTURED = 0,
+    STAT_SAMPLED_OUT,
+    STAT_DISABLED_DROPPED,
+    STAT_RATE_LIMITED,
+    STAT_COALESCED,
+    STAT_QUEUE_DROPPED,
+    STAT_OVERSIZED_DROPPED,
+    STAT_SENT,
+    STAT_FAILED,
+    STAT_RETRIED,
+    STAT_BYTES_SENT,
+    STAT_COUNTER_MAX,
+} stat_counter_t;
+
+typedef enum {
+    STAT_LATENCY_CAPTURE = 0,
+    STAT_LATENCY_SERIALIZE,
+    STAT_LATENCY_HTTP,
+    STAT_LATENCY_MAX,
+} stat_latency_t;
+
+/* One cache line aligned shard per group of threads, aggregated on read */
+typedef struct {
+    uint64_t counters[STAT_COUNTER_MAX];
+    uint64_t sum_ns[STAT_LATENCY_MAX];
+    uint64_t buckets[STAT_LATENCY_MAX][CSENTRY_STATS_BUCKETS];
+} __attribute__((aligned(64))) stats_shard_t;
+
+typedef struct {
+    stats_shard_t shards[STATS_SHARDS];
+} stats_t;
+
+stats_t * _nullable stats_new(void);
+void stats_free(stats_t * _nullable);
+
+void stats_add(stats_t *, stat_counter_t, uint64_t);
+void stats_observe(stats_t *, stat_latency_t, uint64_t);
+void stats_collect(const stats_t *, csentry_stats_t *);
+int stats_write_prometheus(const csentry_stats_t *, const char *);
+
+#endif /* CSENTRY_STATS_H */
@@ -0,0 +1,235 @@
+/*
+ * Created 191021 lynnl
+ */
+
+/* dladdr(3) and Dl_info are GNU extensions on glibc */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <dlfcn.h>
+
+#include "symbolize.h"
+
+/* Must be power of 2 */
+#define SYMBOL_CACHE_SIZE       512u
+#define SYMBOL_CACHE_BUCKETS    1024u
+
+typedef struct sym_entry {
+    struct sym_entry *hnext;    /* Hash chain */
+    struct sym_entry *prev;     /* LRU list, head is the most recently used */
+    struct sym_entry *next;
+    symbol_t sym;
+} sym_entry_t;
+
+/*
+ * Resolution only happens off the capturing threads(i.e. POST data thread),
+ *  a plain mutex is good enough
+ */
+static struct {
+    pthread_mutex_t mtx;
+    sym_entry_t *buckets[SYMBOL_CACHE_BUCKETS];
+    sym_entry_t entries[SYMBOL_CACHE_SIZE];
+    sym_entry_t *head;
+    sym_entry_t *tail;
+    uint32_t used;
+    uint64_t hits;
+    uint64_t misses;
+} cache = {
+    .mtx = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint32_t addr_bucket(const void *addr)
+{
+    return hash_mix64((uintptr_t) addr) & (SYMBOL_CACHE_BUCKETS - 1);
+}
+
+static void lru_unlink(sym_entry_t *e)
+{
+    if (e->prev != NULL) e->prev->next = e->next; else cache.head = e->next;
+    if (e->next != NULL) e->next->prev = e->prev; else cache.tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push_front(sym_entry_t *e)
+{
+    e->prev = NULL;
+    e->next = cache.head;
+    if (cache.head != NULL) cache.head->prev = e; else cache.tail = e;
+    cache.head = e;
+}
+
+static void hash_unlink(sym_entry_t *e)
+{
+    sym_entry_t **pp = &cache.buckets[addr_bucket(e->sym.addr)];
+
+    while (*pp != NULL) {
+        if (*pp == e) {
+            *pp = e->hnext;
+            break;
+        }
+        pp = &(*pp)->hnext;
+    }
+    e->hnext = NULL;
+}
+
+/* cache.mtx must be held */
+static sym_entry_t * _nullable cache_find(const void *addr)
+{
+    sym_entry_t *e;
+
+    for (e = cache.buckets[addr_bucket(addr)]; e != NULL; e = e->hnext) {
+        if (e->sym.addr == addr) break;
+    }
+
+    return e;
+}
+
+/* cache.mtx must be held */
+static void cache_insert(const symbol_t *sym)
+{
+    sym_entry_t *e;
+    uint32_t b;
+
+    if (cache_find(sym->addr) != NULL) return;     /* Raced by another thread */
+
+    if (cache.used < SYMBOL_CACHE_SIZE) {
+        e = &cache.entries[cache.used++];
+    } else {
+        /* Evict the least recently used one */
+        e = cache.tail;
+        lru_unlink(e);
+        hash_unlink(e);
+    }
+
+    e->sym = *sym;
+    b = addr_bucket(sym->addr);
+    e->hnext = cache.buckets[b];
+    cache.buckets[b] = e;
+    lru_push_front(e);
+}
+
+static void resolve(const void *addr, symbol_t *sym)
+{
+    Dl_info info;
+
+    (void) memset(sym, 0, sizeof(*sym));
+    sym->addr = addr;
+
+    if (dladdr(addr, &info) == 0) return;
+
+    sym->module_base = info.dli_fbase;
+    if (info.dli_fname != NULL) {
+        (void) snprintf(sym->module, sizeof(sym->module), "%s", info.dli_fname);
+    }
+    if (info.dli_sname != NULL) {
+        sym->sym_addr = info.dli_saddr;
+        (void) snprintf(sym->name, sizeof(sym->name), "%s", info.dli_sname);
+    }
+}
+
+/**
+ * Resolve an instruction address into symbol info
+ * Results are cached process-wide, dladdr(3) only called upon cache miss
+ */
+void symbolize(const void *addr, symbol_t *out)
+{
+    sym_entry_t *e;
+
+    assert_nonnull(out);
+
+    pthread_mutex_lock_safe(&cache.mtx);
+    e = cache_find(addr);
+    if (e != NULL) {
+        cache.hits++;
+        lru_unlink(e);
+        lru_push_front(e);
+        *out = e->sym;
+        pthread_mutex_unlock_safe(&cache.mtx);
+        return;
+    }
+    cache.misses++;
+    pthread_mutex_unlock_safe(&cache.mtx);
+
+    /* dladdr(3) may take loader locks, never call it with cache.mtx held */
+    resolve(addr, out);
+
+    pthread_mutex_lock_safe(&cache.mtx);
+    cache_insert(out);
+    pthread_mutex_unlock_safe(&cache.mtx);
+}
+
+/**
+ * Symbolize raw instruction addresses, one frame per line
+ * Same format as backtrace_symbols(3)
+ * @return      Backtrace string(NULL if ENOMEM or no frame)
+ *              You're responsible to free(3) it if it's non-NULL
+ */
+char * _nullable symbolize_backtrace(void * const *pcs, uint32_t n)
+{
+    symbol_t sym;
+    char *output = NULL, *p;
+    size_t cap = 0, len = 0;
+    uint32_t i;
+    int sz;
+
+    assert(!!pcs | !n);
+
+    for (i = 0; i < n; i++) {
+        symbolize(pcs[i], &sym);
+
+        /* Grow geometrically, a frame line rarely exceeds 512 bytes */
+        if (cap - len < SYMBOL_NAME_MAX + SYMBOL_MODULE_MAX + 64) {
+            cap = cap ? cap * 2 : 2048;
+            p = (char *) realloc(output, cap);
+            if (p == NULL) {
+                free(output);
+                return NULL;
+            }
+            output = p;
+        }
+
+        if (sym.sym_addr != NULL) {
+            sz = snprintf(output + len, cap - len, "%s(%s+%#lx) [%p]\n",
+                    sym.module, sym.name,
+                    (unsigned long) ((uintptr_t) sym.addr - (uintptr_t) sym.sym_addr),
+                    sym.addr);
+        } else {
+            sz = snprintf(output + len, cap - len, "%s() [%p]\n", sym.module, sym.addr);
+        }
+        if (sz > 0) len += MIN((size_t) sz, cap - len - 1);
+    }
+
+    return output;
+}
+
+/**
+ * Cache statistics(for diagnosis purpose)
+ */
+void symbol_cache_stats(uint64_t *hits, uint64_t *misses)
+{
+    assert_nonnull(hits);
+    assert_nonnull(misses);
+
+    pthread_mutex_lock_safe(&cache.mtx);
+    *hits = cache.hits;
+    *misses = cache.misses;
+    pthread_mutex_unlock_safe(&cache.mtx);
+}
+
+/**
+ * Drop all cached symbols
+ * Should be called once modules got unloaded, since addresses may be reused
+ */
+void symbol_cache_flush(void)
+{
+    pthread_mutex_lock_safe(&cache.mtx);
+    (void) memset(cache.buckets, 0, sizeof(cache.buckets));
+    cache.head = cache.tail = NULL;
+    cache.used = 0;
+    pthread_mutex_unlock_safe(&cache.mtx);
+}
@@ -0,0 +1,30 @@
+/*
+ * Created 191021 lynnl
+ *
+ * Address to symbol resolution with a process-wide LRU cache
+ */
+
+#ifndef CSENTRY_SYMBOLIZE_H
+#define CSENTRY_SYMBOLIZE_H
+
+#include <stdint.h>
+
+#include "utils.h"
+
+#define SYMBOL_NAME_MAX         128
+#define SYMBOL_MODULE_MAX       256
+
+typedef struct {
+    const void *addr;           /* Instruction address */
+    const void *sym_addr;       /* Start of enclosing symbol, NULL if unknown */
+    const void *module_base;    /* Load address of enclosing module, NULL if unknown */
+    char name[SYMBOL_NAME_MAX];         /* Empty if unknown */
+    char module[SYMBOL_MODULE_MAX];     /* Empty if unknown */
+} symbol_t;
+
+void symbolize(const void *, symbol_t *);
+char * _nullable symbolize_backtrace(void * const *, uint32_t);
+void symbol_cache_stats(uint64_t *, uint64_t *);
+void symbol_cache_flush(void);
+
+#endif /* CSENTRY_SYMBOLIZE_H */
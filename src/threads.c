@@ -0,0 +1,277 @@
+/*
+ * Created 191026 lynnl
+ *
+ * Threads are enumerated via /proc/self/task, each one is asked to unwind
+ *  itself inside a signal handler, results land in preallocated slots
+ * Threads which block the signal(or are stuck in uninterruptible sleep)
+ *  simply miss the deadline
+ */
+
+/* syscall(2) and tgkill are GNU extensions on glibc */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include "threads.h"
+
+/* First few real-time signals are taken by glibc/NPTL internally */
+#define THREADS_SIGNAL          (SIGRTMIN + 4)
+
+#define THREADS_POLL_NS         100000u     /* 100us */
+
+/*
+ * Slot state with capture generation in upper bits
+ * A late handler of a timed out capture can never claim a slot of the next one
+ */
+#define SLOT_PENDING            0u
+#define SLOT_RUNNING            1u
+#define SLOT_DONE               2u
+#define SLOT_ABANDONED          3u
+#define SLOT_STATE(g, s)        (((g) << 2u) | (s))
+
+typedef struct {
+    long tid;
+    uint32_t state;
+    thread_stack_t stack;
+} slot_t;
+
+static pthread_mutex_t capture_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Only modified with capture_mtx held */
+static struct {
+    int installed;
+    uint32_t users;             /* Handler restored once no user left */
+    uint32_t strays;            /* Signals may still be delivered late */
+    struct sigaction old;
+    uint32_t gen;
+    uint32_t n;
+    unwind_fn unwind;
+    slot_t slots[THREADS_MAX];
+} capture;
+
+long threads_current_tid(void)
+{
+#if defined(__linux__)
+    return (long) syscall(SYS_gettid);
+#else
+    return (long) (uintptr_t) pthread_self();
+#endif
+}
+
+static void threads_handler(int signo, siginfo_t *info, void *uctx)
+{
+    int saved_errno = errno;
+    uint32_t gen, n, i, expected;
+    unwind_fn unwind;
+    long tid;
+
+    UNUSED(signo, info);
+
+    gen = __atomic_load_n(&capture.gen, __ATOMIC_ACQUIRE);
+    n = __atomic_load_n(&capture.n, __ATOMIC_ACQUIRE);
+    unwind = __atomic_load_n(&capture.unwind, __ATOMIC_ACQUIRE);
+    tid = threads_current_tid();
+
+    for (i = 0; i < n && unwind != NULL; i++) {
+        if (capture.slots[i].tid != tid) continue;
+
+        expected = SLOT_STATE(gen, SLOT_PENDING);
+        if (__atomic_compare_exchange_n(&capture.slots[i].state, &expected,
+                    SLOT_STATE(gen, SLOT_RUNNING), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            capture.slots[i].stack.nframes = unwind_signal(unwind, uctx,
+                    capture.slots[i].stack.frames, THREADS_MAX_FRAMES);
+            __atomic_store_n(&capture.slots[i].state,
+                    SLOT_STATE(gen, SLOT_DONE), __ATOMIC_RELEASE);
+        }
+        break;
+    }
+
+    errno = saved_errno;
+}
+
+#if defined(__linux__)
+static int threads_install(void)
+{
+    struct sigaction sa;
+
+    if (capture.installed) return 0;
+
+    /* Never steal the signal from a handler installed by others */
+    if (sigaction(THREADS_SIGNAL, NULL, &capture.old) != 0) return -1;
+    if ((capture.old.sa_flags & SA_SIGINFO) ||
+            (capture.old.sa_handler != SIG_DFL && capture.old.sa_handler != SIG_IGN)) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    (void) memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = threads_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    (void) sigemptyset(&sa.sa_mask);
+    if (sigaction(THREADS_SIGNAL, &sa, NULL) != 0) return -1;
+
+    capture.installed = 1;
+    return 0;
+}
+
+/**
+ * Enumerate threads but the calling one into capture slots
+ * @return      Number of slots filled
+ */
+static uint32_t threads_enumerate(long self, uint32_t gen, uint32_t max)
+{
+    DIR *dir;
+    struct dirent *ent;
+    long long tid;
+    uint32_t n = 0;
+
+    dir = opendir("/proc/self/task");
+    if (dir == NULL) return 0;
+
+    while (n < max && (ent = readdir(dir)) != NULL) {
+        if (!parse_llong(ent->d_name, '\0', 10, &tid) || tid == self) continue;
+        capture.slots[n].tid = (long) tid;
+        capture.slots[n].stack.tid = (long) tid;
+        capture.slots[n].stack.nframes = 0;
+        __atomic_store_n(&capture.slots[n].state, SLOT_STATE(gen, SLOT_PENDING), __ATOMIC_RELAXED);
+        n++;
+    }
+
+    (void) closedir(dir);
+    return n;
+}
+
+/**
+ * @return      Number of slots still pending
+ */
+static uint32_t threads_pending(uint32_t gen, uint32_t n)
+{
+    uint32_t i, pending = 0;
+    for (i = 0; i < n; i++) {
+        if (__atomic_load_n(&capture.slots[i].state, __ATOMIC_ACQUIRE) <=
+                SLOT_STATE(gen, SLOT_RUNNING)) {
+            pending++;
+        }
+    }
+    return pending;
+}
+#endif
+
+/**
+ * Take a reference of the capture handler, installed lazily upon first capture
+ */
+void threads_retain(void)
+{
+    pthread_mutex_lock_safe(&capture_mtx);
+    capture.users++;
+    pthread_mutex_unlock_safe(&capture_mtx);
+}
+
+/**
+ * Drop a reference, previous handler restored once no user left
+ * It's kept if any signal may still arrive, default action of which
+ *  would terminate the process
+ */
+void threads_release(void)
+{
+    pthread_mutex_lock_safe(&capture_mtx);
+    assert(capture.users != 0);
+    if (--capture.users == 0 && capture.installed && capture.strays == 0) {
+        if (sigaction(THREADS_SIGNAL, &capture.old, NULL) == 0) capture.installed = 0;
+    }
+    pthread_mutex_unlock_safe(&capture_mtx);
+}
+
+/**
+ * Capture stacks of all threads but the calling one
+ * Captures are serialized process-wide
+ *
+ * @unwind      Unwinder run inside each thread's signal handler
+ * @out         Stacks, ordered as in /proc/self/task
+ * @size        Capacity of `out'
+ * @timeout_ms  Deadline of the whole capture, late threads are left out
+ * @return      Number of stacks stored  -1 o.w.(errno will be set)
+ *              ENOTSUP if thread enumeration isn't supported
+ *              EBUSY if the signal is taken by another handler
+ */
+int threads_capture(unwind_fn unwind, thread_stack_t *out, uint32_t size, uint32_t timeout_ms)
+{
+#if defined(__linux__)
+    int e = 0;
+    struct timespec ts = {0, THREADS_POLL_NS};
+    uint64_t deadline;
+    uint32_t gen, n, i, expected;
+    pid_t pid = getpid();
+    long self = threads_current_tid();
+
+    assert_nonnull(unwind);
+    assert_nonnull(out);
+
+    pthread_mutex_lock_safe(&capture_mtx);
+
+    if (threads_install() != 0) set_err_jmp(-1, unlock);
+
+    /* Generation bits wrap around harmlessly */
+    gen = (capture.gen + 1) & (UINT32_MAX >> 2u);
+    __atomic_store_n(&capture.n, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&capture.gen, gen, __ATOMIC_RELEASE);
+    __atomic_store_n(&capture.unwind, unwind, __ATOMIC_RELEASE);
+
+    n = threads_enumerate(self, gen, MIN(size, THREADS_MAX));
+    __atomic_store_n(&capture.n, n, __ATOMIC_RELEASE);
+
+    for (i = 0; i < n; i++) {
+        if (syscall(SYS_tgkill, pid, capture.slots[i].tid, THREADS_SIGNAL) != 0) {
+            /* Thread exited in between */
+            __atomic_store_n(&capture.slots[i].state,
+                    SLOT_STATE(gen, SLOT_ABANDONED), __ATOMIC_RELEASE);
+        }
+    }
+
+    deadline = monotonic_ns() + timeout_ms * 1000000ull;
+    while (threads_pending(gen, n) != 0 && monotonic_ns() < deadline) {
+        (void) nanosleep(&ts, NULL);
+    }
+
+    for (i = 0; i < n; i++) {
+        expected = SLOT_STATE(gen, SLOT_PENDING);
+        if (__atomic_compare_exchange_n(&capture.slots[i].state, &expected,
+                    SLOT_STATE(gen, SLOT_ABANDONED), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            /* Its signal is still pending */
+            capture.strays++;
+        }
+        /* A handler already running is about to finish */
+        while (__atomic_load_n(&capture.slots[i].state, __ATOMIC_ACQUIRE) ==
+                SLOT_STATE(gen, SLOT_RUNNING)) {
+            (void) sched_yield();
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        if (capture.slots[i].state == SLOT_STATE(gen, SLOT_DONE)) {
+            (void) memcpy(&out[e++], &capture.slots[i].stack, sizeof(*out));
+        }
+    }
+
+out_unlock:
+    pthread_mutex_unlock_safe(&capture_mtx);
+    return e;
+#else
+    UNUSED(unwind, out, size, timeout_ms);
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
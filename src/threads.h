@@ -0,0 +1,29 @@
+/*
+ * Created 191026 lynnl
+ *
+ * Stacks of all threads in the process
+ */
+
+#ifndef CSENTRY_THREADS_H
+#define CSENTRY_THREADS_H
+
+#include <stdint.h>
+
+#include "utils.h"
+#include "unwind.h"
+
+#define THREADS_MAX             128
+#define THREADS_MAX_FRAMES      64
+
+typedef struct {
+    long tid;
+    uint32_t nframes;
+    void *frames[THREADS_MAX_FRAMES];
+} thread_stack_t;
+
+long threads_current_tid(void);
+void threads_retain(void);
+void threads_release(void);
+int threads_capture(unwind_fn, thread_stack_t *, uint32_t, uint32_t);
+
+#endif /* CSENTRY_THREADS_H */
@@ -0,0 +1,253 @@
+/*
+ * Created 191031 lynnl
+ *
+ * Never blocks nor retries: datagrams not taken by the kernel right away
+ *  are dropped and accounted by the caller
+ */
+
+/* sendmmsg(2) is a GNU extension on glibc */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "udp.h"
+
+/**
+ * @addr        "HOST:PORT", IPv6 host in brackets
+ * @return      Connected socket  NULL o.w.(errno will be set)
+ */
+udp_t * _nullable udp_new(const char *addr)
+{
+    struct addrinfo hints;
+    struct addrinfo *res = NULL, *ai;
+    char host[256];
+    const char *port;
+    size_t n;
+    udp_t *udp;
+    int fd = -1;
+
+    assert_nonnull(addr);
+
+    port = strrchr(addr, ':');
+    n = port != NULL ? (size_t) (port - addr) : 0;
+    if (n > 1 && addr[0] == '[' && addr[n - 1] == ']') {
+        addr++;
+        n -= 2;
+    }
+    if (n == 0 || n >= sizeof(host) || port[1] == '\0') {
+        errno = EINVAL;
+        return NULL;
+    }
+    (void) memcpy(host, addr, n);
+    host[n] = '\0';
+    port++;
+
+    (void) memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        errno = EADDRNOTAVAIL;
+        return NULL;
+    }
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        (void) close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) return NULL;
+
+    (void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+    (void) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    udp = (udp_t *) malloc(sizeof(*udp));
+    if (udp == NULL) {
+        (void) close(fd);
+        return NULL;
+    }
+    udp->fd = fd;
+
+    return udp;
+}
+
+void udp_free(udp_t * _nullable udp)
+{
+    if (udp != NULL) {
+        (void) close(udp->fd);
+        free(udp);
+    }
+}
+
+#ifdef HAVE_ZLIB
+static const char b64_table[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/**
+ * @return      Bytes written(4 * ceil(n / 3))
+ */
+static size_t base64_encode(const unsigned char *src, size_t n, char *dst)
+{
+    char *p = dst;
+    uint32_t v;
+    size_t i;
+
+    for (i = 0; i + 2 < n; i += 3) {
+        v = (uint32_t) src[i] << 16u | (uint32_t) src[i + 1] << 8u | src[i + 2];
+        *p++ = b64_table[v >> 18u];
+        *p++ = b64_table[(v >> 12u) & 0x3fu];
+        *p++ = b64_table[(v >> 6u) & 0x3fu];
+        *p++ = b64_table[v & 0x3fu];
+    }
+
+    if (i < n) {
+        v = (uint32_t) src[i] << 16u;
+        if (i + 1 < n) v |= (uint32_t) src[i + 1] << 8u;
+        *p++ = b64_table[v >> 18u];
+        *p++ = b64_table[(v >> 12u) & 0x3fu];
+        *p++ = i + 1 < n ? b64_table[(v >> 6u) & 0x3fu] : '=';
+        *p++ = '=';
+    }
+
+    return p - dst;
+}
+#endif
+
+/**
+ * Build a datagram of an event
+ *
+ * @auth        X-Sentry-Auth header value
+ * @len         [out] Datagram length
+ * @return      Datagram(free(3) after use)  NULL o.w.(errno will be set)
+ *              EMSGSIZE if it exceeds UDP_DATAGRAM_MAX
+ */
+char * _nullable udp_encode(const char *auth, const char *data, size_t size, size_t *len)
+{
+    size_t alen, total;
+    char *buf = NULL;
+#ifdef HAVE_ZLIB
+    uLongf zlen;
+    Bytef *z;
+#endif
+
+    assert_nonnull(auth);
+    assert_nonnull(data);
+    assert_nonnull(len);
+
+    alen = strlen(auth);
+
+#ifdef HAVE_ZLIB
+    zlen = compressBound((uLong) size);
+    z = (Bytef *) malloc(zlen);
+    if (z == NULL) return NULL;
+
+    /* Favor worker CPU over ratio, events are mostly small */
+    if (compress2(z, &zlen, (const Bytef *) data, (uLong) size, Z_BEST_SPEED) != Z_OK) {
+        errno = ENOMEM;
+        goto out_free;
+    }
+
+    total = alen + 2 + 4 * ((zlen + 2) / 3);
+    if (total > UDP_DATAGRAM_MAX) {
+        errno = EMSGSIZE;
+        goto out_free;
+    }
+
+    buf = (char *) malloc(total);
+    if (buf == NULL) goto out_free;
+    (void) memcpy(buf, auth, alen);
+    (void) memcpy(buf + alen, "\n\n", 2);
+    *len = alen + 2 + base64_encode(z, zlen, buf + alen + 2);
+
+out_free:
+    free(z);
+#else
+    total = alen + 2 + size;
+    if (total > UDP_DATAGRAM_MAX) {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+
+    buf = (char *) malloc(total);
+    if (buf != NULL) {
+        (void) memcpy(buf, auth, alen);
+        (void) memcpy(buf + alen, "\n\n", 2);
+        (void) memcpy(buf + alen + 2, data, size);
+        *len = total;
+    }
+#endif
+
+    return buf;
+}
+
+/**
+ * Send datagrams without blocking, sendmmsg(2) batches on Linux
+ * @return      Number of datagrams taken by the kernel(the rest dropped)
+ */
+int udp_send(udp_t *udp, const udp_datagram_t *dgrams, uint32_t n)
+{
+    int sent = 0;
+    int refused = 0;
+#if defined(__linux__)
+    struct mmsghdr msgs[UDP_BATCH_MAX];
+    struct iovec iov[UDP_BATCH_MAX];
+    uint32_t i, m;
+    int r;
+
+    assert_nonnull(udp);
+    assert_nonnull(dgrams);
+
+    while ((uint32_t) sent < n) {
+        m = MIN(n - (uint32_t) sent, UDP_BATCH_MAX);
+        (void) memset(msgs, 0, sizeof(msgs[0]) * m);
+        for (i = 0; i < m; i++) {
+            iov[i].iov_base = dgrams[sent + i].buf;
+            iov[i].iov_len = dgrams[sent + i].len;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        r = sendmmsg(udp->fd, msgs, m, MSG_DONTWAIT);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            /* ICMP port unreachable of an earlier datagram, reported once */
+            if (errno == ECONNREFUSED && !refused++) continue;
+            break;
+        }
+        sent += r;
+        /* Socket buffer full */
+        if ((uint32_t) r < m) break;
+    }
+#else
+    assert_nonnull(udp);
+    assert_nonnull(dgrams);
+
+    while ((uint32_t) sent < n) {
+        if (send(udp->fd, dgrams[sent].buf, dgrams[sent].len, MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) continue;
+            if (errno == ECONNREFUSED && !refused++) continue;
+            break;
+        }
+        sent++;
+    }
+#endif
+
+    return sent;
+}
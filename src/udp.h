@@ -0,0 +1,35 @@
+/*
+ * Created 191031 lynnl
+ *
+ * Fire-and-forget UDP transport(legacy Sentry UDP protocol)
+ * Datagram: X-Sentry-Auth header value, "\n\n", base64(zlib(event json))
+ *  plain event json if built without zlib
+ */
+
+#ifndef CSENTRY_UDP_H
+#define CSENTRY_UDP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "utils.h"
+
+#define UDP_DEFAULT_ADDR        "127.0.0.1:9001"
+#define UDP_DATAGRAM_MAX        65000u      /* Below IPv4 limit 65507 */
+#define UDP_BATCH_MAX           32u         /* Datagrams per sendmmsg(2) */
+
+typedef struct {
+    char *buf;
+    size_t len;
+} udp_datagram_t;
+
+typedef struct {
+    int fd;                     /* Connected, non-blocking */
+} udp_t;
+
+udp_t * _nullable udp_new(const char *);
+void udp_free(udp_t * _nullable);
+char * _nullable udp_encode(const char *, const char *, size_t, size_t *);
+int udp_send(udp_t *, const udp_datagram_t *, uint32_t);
+
+#endif /* CSENTRY_UDP_H */
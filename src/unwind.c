@@ -0,0 +1,248 @@
+/*
+ * Created 191023 lynnl
+ */
+
+/* pthread_getattr_np(3) is a GNU extension on glibc */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <string.h>
+#include <pthread.h>
+#include <ucontext.h>
+
+#if defined(__unix__) || defined(__unix) || defined(unix) || (defined(__APPLE__) && defined(__MACH__))
+#include <execinfo.h>
+#endif
+
+#ifdef HAVE_LIBUNWIND
+#define UNW_LOCAL_ONLY
+#include <libunwind.h>
+#endif
+
+#include "unwind.h"
+
+static const char *unwinder_names[] = {
+    "backtrace", "fp", "libunwind",
+};
+
+static uint32_t unwind_backtrace(void **pcs, uint32_t max)
+{
+    /*
+     * Linux, macOS, OpenBSD uses `int' as return type
+     * FreeBSD, NetBSD, DragonFlyBSD uses `size_t' as return type
+     */
+    return (uint32_t) backtrace(pcs, max);
+}
+
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+#define HAVE_FP_UNWINDER        1
+
+/*
+ * Stack range of the calling thread, looked up once per thread
+ * Both zero if unknown, walker then relies on frame sanity checks only
+ */
+static __thread uintptr_t stack_lo = 0;
+static __thread uintptr_t stack_hi = 0;
+static __thread int stack_probed = 0;
+
+static void probe_stack_range(void)
+{
+#if defined(__linux__)
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+            stack_lo = (uintptr_t) addr;
+            stack_hi = (uintptr_t) addr + size;
+        }
+        (void) pthread_attr_destroy(&attr);
+    }
+#elif defined(__APPLE__) && defined(__MACH__)
+    stack_hi = (uintptr_t) pthread_get_stackaddr_np(pthread_self());
+    stack_lo = stack_hi - pthread_get_stacksize_np(pthread_self());
+#endif
+    stack_probed = 1;
+}
+
+/* Upper bound of a single frame if stack range unknown */
+#define FP_MAX_FRAME_SIZE       (1u << 20u)
+
+/**
+ * Walk the frame pointer chain
+ * Only meaningful if the whole program compiled with -fno-omit-frame-pointer,
+ *  walking stops at the first frame fails sanity checks
+ *
+ * Frame layout on x86, x86_64 and aarch64:
+ *  fp[0]   saved frame pointer of the caller
+ *  fp[1]   return address
+ */
+static uint32_t fp_walk(uintptr_t *fp, void **pcs, uint32_t max)
+{
+    uintptr_t *next;
+    uint32_t n = 0;
+
+    while (n < max && fp != NULL) {
+        if ((uintptr_t) fp & (sizeof(*fp) - 1)) break;
+        if (stack_hi != 0 && ((uintptr_t) fp < stack_lo ||
+                    (uintptr_t) (fp + 2) > stack_hi)) break;
+
+        if (fp[1] == 0) break;
+        pcs[n++] = (void *) fp[1];
+
+        /* Stack grows downwards, caller frames must locate higher */
+        next = (uintptr_t *) fp[0];
+        if (next <= fp) break;
+        if (stack_hi == 0 && (uintptr_t) next - (uintptr_t) fp > FP_MAX_FRAME_SIZE) break;
+        fp = next;
+    }
+
+    return n;
+}
+
+__attribute__((noinline))
+static uint32_t unwind_fp(void **pcs, uint32_t max)
+{
+    if (!stack_probed) probe_stack_range();
+    return fp_walk((uintptr_t *) __builtin_frame_address(0), pcs, max);
+}
+#endif
+
+#ifdef HAVE_LIBUNWIND
+static uint32_t unwind_libunwind(void **pcs, uint32_t max)
+{
+    unw_context_t uc;
+    unw_cursor_t cursor;
+    unw_word_t ip;
+    uint32_t n = 0;
+
+    if (unw_getcontext(&uc) != 0) return 0;
+    if (unw_init_local(&cursor, &uc) != 0) return 0;
+
+    /* Skip unwind_libunwind() itself, as other unwinders do */
+    while (n < max && unw_step(&cursor) > 0) {
+        if (unw_get_reg(&cursor, UNW_REG_IP, &ip) != 0 || ip == 0) break;
+        pcs[n++] = (void *) ip;
+    }
+
+    return n;
+}
+#endif
+
+/**
+ * @return      The unwinder function  NULL if not available in this build
+ */
+unwind_fn _nullable unwinder_get(unwinder_t type)
+{
+    switch (type) {
+    case UNWINDER_BACKTRACE:
+        return unwind_backtrace;
+#ifdef HAVE_FP_UNWINDER
+    case UNWINDER_FP:
+        return unwind_fp;
+#endif
+#ifdef HAVE_LIBUNWIND
+    case UNWINDER_LIBUNWIND:
+        return unwind_libunwind;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+const char *unwinder_name(unwinder_t type)
+{
+    return type < ARRAY_SIZE(unwinder_names) ? unwinder_names[type] : "(unknown)";
+}
+
+/**
+ * Program counter, stack and frame pointer of an interrupted context
+ * All left zero if unknown
+ */
+void unwind_ucontext_regs(
+        const void * _nullable uctx,
+        uintptr_t *pc,
+        uintptr_t *sp,
+        uintptr_t *fp)
+{
+    const ucontext_t *uc = (const ucontext_t *) uctx;
+
+    assert_nonnull(pc);
+    assert_nonnull(sp);
+    assert_nonnull(fp);
+
+    *pc = *sp = *fp = 0;
+    if (uc == NULL) return;
+#if defined(__linux__) && defined(__x86_64__)
+    *pc = (uintptr_t) uc->uc_mcontext.gregs[REG_RIP];
+    *sp = (uintptr_t) uc->uc_mcontext.gregs[REG_RSP];
+    *fp = (uintptr_t) uc->uc_mcontext.gregs[REG_RBP];
+#elif defined(__linux__) && defined(__i386__)
+    *pc = (uintptr_t) uc->uc_mcontext.gregs[REG_EIP];
+    *sp = (uintptr_t) uc->uc_mcontext.gregs[REG_ESP];
+    *fp = (uintptr_t) uc->uc_mcontext.gregs[REG_EBP];
+#elif defined(__linux__) && defined(__aarch64__)
+    *pc = (uintptr_t) uc->uc_mcontext.pc;
+    *sp = (uintptr_t) uc->uc_mcontext.sp;
+    *fp = (uintptr_t) uc->uc_mcontext.regs[29];
+#elif defined(__APPLE__) && defined(__x86_64__)
+    *pc = (uintptr_t) uc->uc_mcontext->__ss.__rip;
+    *sp = (uintptr_t) uc->uc_mcontext->__ss.__rsp;
+    *fp = (uintptr_t) uc->uc_mcontext->__ss.__rbp;
+#elif defined(__APPLE__) && defined(__aarch64__)
+    *pc = (uintptr_t) uc->uc_mcontext->__ss.__pc;
+    *sp = (uintptr_t) uc->uc_mcontext->__ss.__sp;
+    *fp = (uintptr_t) uc->uc_mcontext->__ss.__fp;
+#endif
+}
+
+/**
+ * Unwind the interrupted context from inside a signal handler
+ * The interrupted instruction comes first, handler frames are dropped
+ * Frame pointer walker starts from the interrupted frame directly,
+ *  and never probes stack range there(pthread_getattr_np(3) isn't async-signal-safe)
+ *
+ * @return      Number of frames stored
+ */
+uint32_t unwind_signal(
+        unwind_fn unwind,
+        const void * _nullable uctx,
+        void **pcs,
+        uint32_t max)
+{
+    uintptr_t pc, sp, fp;
+    uint32_t i = 0, n;
+
+    assert_nonnull(unwind);
+    assert_nonnull(pcs);
+
+    if (max == 0) return 0;
+
+    unwind_ucontext_regs(uctx, &pc, &sp, &fp);
+    UNUSED(sp);
+
+#ifdef HAVE_FP_UNWINDER
+    if (unwind == unwind_fp && pc != 0) {
+        pcs[0] = (void *) pc;
+        return 1 + fp_walk((uintptr_t *) fp, pcs + 1, max - 1);
+    }
+#endif
+
+    n = unwind(pcs, max);
+    if (pc != 0) {
+        /* Drop handler frames if the unwinder walked through the signal frame */
+        while (i < n && (uintptr_t) pcs[i] != pc) i++;
+        if (i < n) {
+            (void) memmove(pcs, pcs + i, (n - i) * sizeof(*pcs));
+            n -= i;
+        } else {
+            (void) memmove(pcs + 1, pcs, MIN(n, max - 1) * sizeof(*pcs));
+            pcs[0] = (void *) pc;
+            n = MIN(n + 1, max);
+        }
+    }
+
+    return n;
+}
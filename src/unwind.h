@@ -0,0 +1,33 @@
+/*
+ * Created 191023 lynnl
+ *
+ * Stack unwinders of the calling thread
+ */
+
+#ifndef CSENTRY_UNWIND_H
+#define CSENTRY_UNWIND_H
+
+#include <stdint.h>
+
+#include "utils.h"
+
+typedef enum {
+    UNWINDER_BACKTRACE = 0,     /* backtrace(3), always available */
+    UNWINDER_FP = 1,            /* Frame pointer walker */
+    UNWINDER_LIBUNWIND = 2,     /* Requires building with libunwind */
+    UNWINDER_MAX,
+} unwinder_t;
+
+/**
+ * Record return addresses of the calling thread
+ * @return      Number of frames stored
+ */
+typedef uint32_t (*unwind_fn)(void **, uint32_t);
+
+unwind_fn _nullable unwinder_get(unwinder_t);
+const char *unwinder_name(unwinder_t);
+
+void unwind_ucontext_regs(const void * _nullable, uintptr_t *, uintptr_t *, uintptr_t *);
+uint32_t unwind_signal(unwind_fn, const void * _nullable, void **, uint32_t);
+
+#endif /* CSENTRY_UNWIND_H */
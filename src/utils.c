@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "utils.h"
 
@@ -38,14 +39,72 @@ int strprefix(const char *s1, const char *s2)
  */
 void format_iso_8601_time(char *str)
 {
-    time_t now;
+    format_iso_8601_epoch(str, time(NULL));
+}
+
+/**
+ * Format given Unix epoch as ISO 8601 datetime without trailing timezone
+ */
+void format_iso_8601_epoch(char *str, time_t t)
+{
+    struct tm tm;
 
     assert_nonnull(str);
-    (void) time(&now);
 
     *str = '\0';
-    /* gmtime(3) should never return NULL in such case */
-    (void) strftime(str, ISO_8601_BUFSZ, "%Y-%m-%dT%H:%M:%S", gmtime(&now));
+    if (gmtime_r(&t, &tm) != NULL) {
+        (void) strftime(str, ISO_8601_BUFSZ, "%Y-%m-%dT%H:%M:%S", &tm);
+    }
+}
+
+/**
+ * @return  Monotonic clock time in nanoseconds
+ */
+uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    /* CLOCK_MONOTONIC is always supported */
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+#define RUNTIME_DIR_ENV     "XDG_RUNTIME_DIR"
+
+/**
+ * Resolve a directory private to current user, created if missing
+ * @param path      Directory to use  NULL for the per-user runtime directory:
+ *                  $XDG_RUNTIME_DIR/csentry, /tmp/csentry-<uid> as a fallback
+ * @return          0 if success  -1 otherwise(errno will be set)
+ *                  EPERM if not a directory owned by us or others can access it
+ */
+int private_dir(const char * _nullable path, char *buf, size_t size)
+{
+    const char *dir;
+    struct stat st;
+    int n;
+
+    if (path != NULL) {
+        n = snprintf(buf, size, "%s", path);
+    } else if ((dir = getenv(RUNTIME_DIR_ENV)) != NULL && *dir != '\0') {
+        n = snprintf(buf, size, "%s/csentry", dir);
+    } else {
+        n = snprintf(buf, size, "/tmp/csentry-%u", (unsigned) getuid());
+    }
+    if (n < 0 || (size_t) n >= size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if (mkdir(buf, 0700) != 0 && errno != EEXIST) return -1;
+
+    /* Someone else may have planted it first, lstat(2) so a symlink is refused */
+    if (lstat(buf, &st) != 0) return -1;
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+        errno = EPERM;
+        return -1;
+    }
+
+    return 0;
 }
 
 /**
@@ -125,6 +184,34 @@ void pthread_cond_wait_safe(pthread_cond_t *cond, pthread_mutex_t *mtx)
     assert(e == 0);
 }
 
+/**
+ * Wait on a condition with a relative timeout
+ * @timeout     Timeout in nanoseconds
+ * @return      0 if signaled  ETIMEDOUT if timed out
+ */
+int pthread_cond_timedwait_safe(
+        pthread_cond_t *cond,
+        pthread_mutex_t *mtx,
+        uint64_t timeout)
+{
+    int e;
+    struct timespec ts;
+    uint64_t ns;
+
+    assert_nonnull(cond);
+    assert_nonnull(mtx);
+
+    /* pthread_cond_timedwait(3) uses CLOCK_REALTIME by default */
+    (void) clock_gettime(CLOCK_REALTIME, &ts);
+    ns = (uint64_t) ts.tv_nsec + timeout;
+    ts.tv_sec += ns / 1000000000u;
+    ts.tv_nsec = ns % 1000000000u;
+
+    e = pthread_cond_timedwait(cond, mtx, &ts);
+    assert(e == 0 || e == ETIMEDOUT);
+    return e;
+}
+
 void pthread_cond_signal_safe(pthread_cond_t *cond)
 {
     int e;
@@ -276,23 +363,130 @@ int parse_llong(const char *str, char delim, int base, long long *val)
     return ok;
 }
 
+/*
+ * Per-thread xorshift64* state, zero means not yet seeded
+ * see: https://en.wikipedia.org/wiki/Xorshift#xorshift*
+ */
+static __thread uint64_t rand_state = 0;
+static pthread_once_t rand_once = PTHREAD_ONCE_INIT;
+
+/*
+ * The forking thread is the only one in the child, its state is inherited
+ *  reseed lest all children of a prefork master draw the same numbers
+ */
+static void rand_atfork_child(void)
+{
+    rand_state = 0;
+}
+
+static void rand_register(void)
+{
+    (void) pthread_atfork(NULL, NULL, rand_atfork_child);
+}
+
+/**
+ * Seed the calling thread's PRNG
+ * Address of the thread-local state is mixed in, so threads seeded within
+ *  the same nanosecond still diverge
+ */
+static void rand_seed(void)
+{
+    struct timespec ts;
+    uint64_t s;
+
+    (void) pthread_once(&rand_once, rand_register);
+    (void) clock_gettime(CLOCK_REALTIME, &ts);
+
+    s = (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+    s ^= (uint64_t) getpid() << 32u;
+    s ^= (uint64_t) (uintptr_t) &rand_state;
+    s = hash_mix64(s);
+
+    /* xorshift state must be nonzero */
+    rand_state = s != 0 ? s : 0x9e3779b97f4a7c15ull;
+}
+
+/**
+ * Generate a 64-bit pseudo random number
+ * Lock-free: each thread owns its PRNG state
+ */
+uint64_t rand_u64(void)
+{
+    uint64_t x;
+
+    if (rand_state == 0) rand_seed();
+
+    x = rand_state;
+    x ^= x >> 12u;
+    x ^= x << 25u;
+    x ^= x >> 27u;
+    rand_state = x;
+
+    return x * 0x2545f4914f6cdd1dull;
+}
+
 /**
  * Generate a random number [lo, hi)
  */
 uint32_t generate_rand(uint32_t lo, uint32_t hi)
 {
+    uint64_t v;
+
     assert(lo < hi);
 
-#if (defined(__APPLE__) && defined(__MACH__)) || defined(__FreeBSD__) || defined(__DragonflyBSD__)
-    return lo + arc4random_uniform(hi);
-#elif defined(__unix__) || defined(__unix) || defined(unix)
-    unsigned long v;
-    srandom(time(NULL) ^ (getpid() << 17u));
-    v = (unsigned long) random();
-    v = (v >> 16u) ^ ((uint32_t) v);
-    return lo + v % (hi - lo);
-#else
-#error "Unsupported operating system!"
-#endif
+    /*
+     * Map upper 32 bits into [0, hi - lo) via multiply-shift
+     * see: https://lemire.me/blog/2016/06/27/a-fast-alternative-to-the-modulo-reduction/
+     */
+    v = rand_u64() >> 32u;
+    return lo + (uint32_t) ((v * (hi - lo)) >> 32u);
 }
 
+/**
+ * Finalizer of MurmurHash3, spread entropy over all 64 bits
+ * see: https://github.com/aappleby/smhasher/wiki/MurmurHash3
+ */
+uint64_t hash_mix64(uint64_t h)
+{
+    h ^= h >> 33u;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33u;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33u;
+    return h;
+}
+
+/**
+ * 64-bit FNV-1a hash over a byte buffer, finalized with hash_mix64()
+ * see: http://www.isthe.com/chongo/tech/comp/fnv/index.html
+ */
+uint64_t hash64(const void *buf, size_t size, uint64_t seed)
+{
+    const unsigned char *p = (const unsigned char *) buf;
+    uint64_t h = 0xcbf29ce484222325ull ^ seed;
+
+    assert(!!buf | !size);
+
+    while (size--) {
+        h ^= *p++;
+        h *= 0x100000001b3ull;
+    }
+
+    return hash_mix64(h);
+}
+
+uint64_t hash64_str(const char *str, uint64_t seed)
+{
+    assert_nonnull(str);
+    return hash64(str, strlen(str), seed);
+}
+
+/**
+ * Map a hash value into [lo, hi) deterministically
+ * Same hash always yield the same value across threads and processes
+ */
+uint32_t hash_to_range(uint64_t h, uint32_t lo, uint32_t hi)
+{
+    assert(lo < hi);
+    return lo + (uint32_t) (((h >> 32u) * (hi - lo)) >> 32u);
+}
@@ -6,6 +6,8 @@
 #define CSENTRY_UTILS_H
 
 #include <assert.h>
+#include <stdint.h>
+#include <time.h>
 #include <uuid/uuid.h>
 #include <pthread.h>
 
@@ -55,6 +57,9 @@ int strprefix(const char *, const char *);
 #define ISO_8601_BUFSZ      20
 
 void format_iso_8601_time(char *);
+void format_iso_8601_epoch(char *, time_t);
+uint64_t monotonic_ns(void);
+int private_dir(const char * _nullable, char *, size_t);
 
 int uuid_parse32(const char *, uuid_t);
 void uuid_string_random(uuid_string_t);
@@ -64,6 +69,7 @@ void pthread_mutex_lock_safe(pthread_mutex_t *);
 void pthread_mutex_unlock_safe(pthread_mutex_t *);
 void pthread_mutex_destroy_safe(pthread_mutex_t *);
 void pthread_cond_wait_safe(pthread_cond_t *, pthread_mutex_t *);
+int pthread_cond_timedwait_safe(pthread_cond_t *, pthread_mutex_t *, uint64_t);
 void pthread_cond_signal_safe(pthread_cond_t *);
 void pthread_cond_destroy_safe(pthread_cond_t *);
 
@@ -84,7 +90,13 @@ cJSON * _nullable cjson_set_default_str_to_obj(
 
 int parse_llong(const char *, char, int, long long *);
 
+uint64_t rand_u64(void);
 uint32_t generate_rand(uint32_t, uint32_t);
 
+uint64_t hash_mix64(uint64_t);
+uint64_t hash64(const void * _nullable, size_t, uint64_t);
+uint64_t hash64_str(const char *, uint64_t);
+uint32_t hash_to_range(uint64_t, uint32_t, uint32_t);
+
 #endif /* CSENTRY_UTILS_H */
 
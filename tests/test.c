@@ -8,10 +8,35 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "../include/csentry.h"
 #include "../src/utils.h"
+#include "../src/ratelimit.h"
+#include "../src/symbolize.h"
+#include "../src/modules.h"
+#include "../src/unwind.h"
+#include "../src/crash.h"
+#include "../src/threads.h"
+#include "../src/shmring.h"
+#include "../src/relay.h"
+#include "../src/udp.h"
+#include "../src/http.h"
+#include "../src/body.h"
+#include "../src/envelope.h"
 
 #define LOG(fmt, ...)       (void) printf("[INFO] " fmt "\n", ##__VA_ARGS__)
 #define LOG_ERR(fmt, ...)   (void) fprintf(stderr, "[ERR] " fmt "\n", ##__VA_ARGS__)
@@ -37,6 +62,19 @@ static void baseline_test(void)
     csentry_debug(handle);
     csentry_destroy(handle);
 
+    /* Fan-out to multiple DSNs */
+    handle = csentry_new("https://eeadde0381684a339597770ce54b4c66@sentry.io/1489851, "
+                         "http://35fe8d8277744ef7925c4784cb2e1d39@127.0.0.1:9/123", NULL, 1.0f, 0);
+    assert_nonnull(handle);
+    csentry_debug(handle);
+    csentry_destroy(handle);
+
+    handle = csentry_new("https://eeadde0381684a339597770ce54b4c66@sentry.io/1489851,", NULL, 1.0f, 0);
+    assert(handle == NULL && errno == EDOM);
+
+    handle = csentry_new("http://a@h/1,http://b@h/2,http://c@h/3,http://d@h/4,http://e@h/5", NULL, 1.0f, 0);
+    assert(handle == NULL && errno == EDOM);
+
     handle = csentry_new("https://eeadde0381684a339597770ce54b4c66@sentry.io/1489851", NULL, 0.5f, 0);
     assert_nonnull(handle);
     csentry_debug(handle);
@@ -210,6 +248,1399 @@ static void breadcrumb_test_v2(void)
     csentry_destroy(handle);
 }
 
+static void rand_test(void)
+{
+    void *handle;
+    uint32_t i, r, hits = 0;
+    uint64_t v[2];
+    int fds[2], status, e;
+    ssize_t n;
+    pid_t pid;
+
+    for (i = 0; i < 10000; i++) {
+        r = generate_rand(10, 20);
+        assert(r >= 10 && r < 20);
+        hits += r < 15;
+    }
+    /* Roughly half of them should fall into lower half */
+    assert(hits > 4000 && hits < 6000);
+
+    /* Keyed sampling is deterministic */
+    r = hash_to_range(hash64_str("req-42", 0), 0, 100);
+    assert(r == hash_to_range(hash64_str("req-42", 0), 0, 100));
+    assert(r < 100);
+
+    handle = csentry_new("https://eeadde0381684a339597770ce54b4c66@sentry.io/1489851", NULL, 0.5f, 0);
+    assert_nonnull(handle);
+    csentry_set_enable(handle, 0);
+    csentry_capture_message_keyed(handle, "req-42", CSENTRY_LEVEL_INFO, "Keyed msg");
+    csentry_destroy(handle);
+
+    /* Children of a seeded parent draw apart */
+    (void) rand_u64();
+    e = pipe(fds);
+    assert(e == 0);
+    for (i = 0; i < 2; i++) {
+        pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            v[0] = rand_u64();
+            _exit(write(fds[1], &v[0], sizeof(v[0])) == sizeof(v[0]) ? 0 : 1);
+        }
+        e = waitpid(pid, &status, 0);
+        assert(e == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    n = read(fds[0], v, sizeof(v));
+    assert(n == sizeof(v));
+    assert(v[0] != v[1]);
+    (void) close(fds[0]);
+    (void) close(fds[1]);
+}
+
+static void sample_rate_test(void)
+{
+    void *handle, *nan_handle;
+    char name[32];
+    int i, e;
+
+    handle = csentry_new("https://eeadde0381684a339597770ce54b4c66@sentry.io/1489851", NULL, 1.0f, 0);
+    assert_nonnull(handle);
+
+    e = csentry_set_sample_rate(handle, CSENTRY_LEVEL_DEBUG, 0.001f);
+    assert(e == 0);
+    e = csentry_set_sample_rate(handle, CSENTRY_LEVEL_FATAL, 1.0f);
+    assert(e == 0);
+    e = csentry_set_sample_rate(handle, CSENTRY_LEVEL_INFO, 1.5f);
+    assert(e == -1 && errno == EINVAL);
+    e = csentry_set_sample_rate(handle, CSENTRY_LEVEL_INFO, NAN);
+    assert(e == -1 && errno == EINVAL);
+    e = csentry_set_logger_sample_rate(handle, "noisy", NAN);
+    assert(e == -1 && errno == EINVAL);
+    nan_handle = csentry_new("https://eeadde0381684a339597770ce54b4c66@sentry.io/1489851", NULL, NAN, 0);
+    assert(nan_handle == NULL);
+
+    e = csentry_set_logger_sample_rate(handle, "noisy", 0.0f);
+    assert(e == 0);
+    /* Update an existing logger in place */
+    e = csentry_set_logger_sample_rate(handle, "noisy", 0.25f);
+    assert(e == 0);
+
+    for (i = 0; ; i++) {
+        (void) snprintf(name, sizeof(name), "logger-%d", i);
+        if (csentry_set_logger_sample_rate(handle, name, 0.5f) != 0) break;
+    }
+    assert(errno == ENOSPC);
+
+    csentry_set_enable(handle, 0);
+    csentry_capture_message_logger(handle, "noisy", CSENTRY_LEVEL_DEBUG, "Dropped anyway");
+
+    csentry_destroy(handle);
+}
+
+static void event_id_test(void)
+{
+    void *handle;
+    const char *id;
+    uuid_string_t first;
+    uuid_string_t last;
+    int e;
+
+    handle = csentry_new("https://eeadde0381684a339597770ce54b4c66@sentry.io/1489851", NULL, 1.0f, 0);
+    assert_nonnull(handle);
+
+    /* Keep the event queued, so no network I/O involved */
+    csentry_set_coalesce_window(handle, 60000);
+
+    id = csentry_capture_message(handle, CSENTRY_LEVEL_INFO, "Event id test");
+    assert_nonnull(id);
+    (void) strcpy(first, id);
+    csentry_get_last_event_id_string(handle, last);
+    assert(!strcmp(first, last));
+
+    /* Coalesced occurrence is reported under the same id */
+    id = csentry_capture_message(handle, CSENTRY_LEVEL_INFO, "Event id test");
+    assert(id != NULL && !strcmp(id, first));
+
+    e = csentry_set_sample_rate(handle, CSENTRY_LEVEL_DEBUG, 0.0f);
+    assert(e == 0);
+    id = csentry_capture_message(handle, CSENTRY_LEVEL_DEBUG, "Sampled out");
+    assert(id == NULL);
+    csentry_get_last_event_id_string(handle, last);
+    assert(!strcmp(first, last));
+
+    csentry_destroy(handle);
+}
+
+#define CTX_SNAPSHOT_READERS    4
+
+static volatile int ctx_snapshot_stop = 0;
+
+static void *ctx_snapshot_reader(void *handle)
+{
+    char *p;
+
+    while (!ctx_snapshot_stop) {
+        p = csentry_ctx_get(handle);
+        assert_nonnull(p);
+        free(p);
+    }
+
+    return NULL;
+}
+
+static void ctx_snapshot_test(void)
+{
+    pthread_t t[CTX_SNAPSHOT_READERS];
+    void *handle;
+    cJSON *tags;
+    char *a, *b;
+    int i, e;
+
+    handle = csentry_new("https://eeadde0381684a339597770ce54b4c66@sentry.io/1489851", NULL, 1.0f, 0);
+    assert_nonnull(handle);
+
+    /* Second read served from snapshot */
+    a = csentry_ctx_get(handle);
+    b = csentry_ctx_get(handle);
+    assert(a != NULL && b != NULL && !strcmp(a, b));
+    free(a);
+    free(b);
+
+    tags = cJSON_Parse("{\"snapshot\":\"v2\"}");
+    assert_nonnull(tags);
+    e = csentry_ctx_update_tags(handle, tags);
+    assert(e == 1);
+    cJSON_Delete(tags);
+
+    a = csentry_ctx_get(handle);
+    assert(a != NULL && strstr(a, "v2") != NULL);
+    free(a);
+
+    csentry_add_breadcrumb(handle, NULL, 0, "Snapshot breadcrumb");
+    a = csentry_ctx_get(handle);
+    assert(a != NULL && strstr(a, "Snapshot breadcrumb") != NULL);
+    free(a);
+
+    /* Snapshots retired under lock-free readers */
+    for (i = 0; i < CTX_SNAPSHOT_READERS; i++) {
+        e = pthread_create(&t[i], NULL, ctx_snapshot_reader, handle);
+        assert(e == 0);
+    }
+    tags = cJSON_Parse("{\"racing\":\"tag\"}");
+    assert_nonnull(tags);
+    for (i = 0; i < 200; i++) {
+        csentry_add_breadcrumb(handle, NULL, 0, "Racing breadcrumb");
+        /* Updates of other names take the lock as well */
+        (void) csentry_ctx_update_tags(handle, i & 1 ? tags : NULL);
+        a = csentry_ctx_get(handle);
+        assert_nonnull(a);
+        free(a);
+    }
+    ctx_snapshot_stop = 1;
+    for (i = 0; i < CTX_SNAPSHOT_READERS; i++) {
+        e = pthread_join(t[i], NULL);
+        assert(e == 0);
+    }
+    cJSON_Delete(tags);
+
+    csentry_set_enable(handle, 0);
+    csentry_destroy(handle);
+}
+
+static void stats_test(void)
+{
+    void *handle;
+    csentry_stats_t st;
+    char path[] = "/tmp/csentry-stats-XXXXXX";
+    char buf[4096];
+    const char *id;
+    FILE *fp;
+    size_t n;
+    int fd, e;
+
+    handle = csentry_new("https://eeadde0381684a339597770ce54b4c66@sentry.io/1489851", NULL, 1.0f, 0);
+    assert_nonnull(handle);
+
+    /* Keep the event queued, so no network I/O involved */
+    csentry_set_coalesce_window(handle, 60000);
+
+    id = csentry_capture_message(handle, CSENTRY_LEVEL_INFO, "Stats test");
+    assert_nonnull(id);
+    id = csentry_capture_message(handle, CSENTRY_LEVEL_INFO, "Stats test");
+    assert_nonnull(id);
+    e = csentry_set_sample_rate(handle, CSENTRY_LEVEL_DEBUG, 0.0f);
+    assert(e == 0);
+    id = csentry_capture_message(handle, CSENTRY_LEVEL_DEBUG, "Sampled out");
+    assert(id == NULL);
+
+    csentry_get_stats(handle, &st);
+    assert(st.captured == 1 && st.coalesced == 1);
+    assert(st.sampled_out == 1 && st.disabled_dropped == 0);
+    assert(st.capture_latency.count == 2);
+    assert(st.sent == 0 && st.bytes_sent == 0);
+
+    fd = mkstemp(path);
+    assert(fd >= 0);
+    (void) close(fd);
+    e = csentry_stats_export(handle, path);
+    assert(e == 0);
+
+    fp = fopen(path, "r");
+    assert_nonnull(fp);
+    n = fread(buf, 1, sizeof(buf) - 1, fp);
+    buf[n] = '\0';
+    (void) fclose(fp);
+    (void) unlink(path);
+
+    assert(strstr(buf, "csentry_events_captured_total 1\n") != NULL);
+    assert(strstr(buf, "csentry_events_sampled_out_total 1\n") != NULL);
+    assert(strstr(buf, "csentry_capture_latency_seconds_count 2\n") != NULL);
+    assert(strstr(buf, "csentry_capture_latency_seconds_bucket{le=\"+Inf\"} 2\n") != NULL);
+
+    csentry_set_enable(handle, 0);
+    id = csentry_capture_message(handle, CSENTRY_LEVEL_INFO, "Disabled");
+    assert(id == NULL);
+    csentry_get_stats(handle, &st);
+    assert(st.disabled_dropped == 1);
+
+    csentry_destroy(handle);
+}
+
+#define SHMRING_PRODUCERS       4
+
+static void shmring_test(void)
+{
+    pid_t pids[SHMRING_PRODUCERS];
+    char name[SHMRING_NAME_MAX];
+    char rec[600];
+    shmring_t *ring, *other;
+    char *p;
+    uint32_t len, prio;
+    pid_t pid;
+    int i, n, status, e, pushed;
+
+    (void) snprintf(name, sizeof(name), "/csentry-test-%d", (int) getpid());
+    (void) shm_unlink(name);
+
+    ring = shmring_open(name, 3000);
+    assert(ring == NULL && errno == EINVAL);
+    ring = shmring_open(name, 4096);
+    assert_nonnull(ring);
+
+    /* Only one uploader at a time */
+    other = shmring_open(name, 4096);
+    assert_nonnull(other);
+    e = shmring_lock(ring);
+    assert(e == 0);
+    e = shmring_lock(other);
+    assert(e == -1 && errno == EWOULDBLOCK);
+
+    p = shmring_pop(ring, &len, &prio);
+    assert(p == NULL && errno == EAGAIN);
+    e = shmring_push(other, rec, 2000, 0);
+    assert(e == -1 && errno == EMSGSIZE);
+
+    /* Several laps, records wrap around the end of data area */
+    for (i = 0; i < 64; i++) {
+        (void) memset(rec, 'a' + i % 26, sizeof(rec));
+        for (n = 0; shmring_push(other, rec, sizeof(rec), (uint32_t) i) == 0; n++) continue;
+        assert(errno == ENOSPC && n >= 5);
+        while (n-- > 0) {
+            p = shmring_pop(ring, &len, &prio);
+            assert(p != NULL && len == sizeof(rec) && p[0] == 'a' + i % 26 && p[len - 1] == p[0]);
+            assert(prio == (uint32_t) i);
+            free(p);
+        }
+        p = shmring_pop(ring, &len, &prio);
+        assert(p == NULL && errno == EAGAIN);
+    }
+
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        shmring_close(other);
+        other = shmring_open(name, 4096);
+        _exit(other != NULL && shmring_push(other, "from child", 10, 1) == 0 ? 0 : 1);
+    }
+    e = waitpid(pid, &status, 0);
+    assert(e == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    p = shmring_pop(ring, &len, &prio);
+    assert(p != NULL && len == 10 && !strcmp(p, "from child") && prio == 1);
+    free(p);
+
+    /* Producers racing over head, some of them killed midway */
+    for (i = 0; i < SHMRING_PRODUCERS; i++) {
+        pids[i] = fork();
+        assert(pids[i] >= 0);
+        if (pids[i] == 0) {
+            shmring_close(other);
+            other = shmring_open(name, 4096);
+            if (other == NULL) _exit(1);
+            for (n = 0; n < 2000; ) {
+                (void) snprintf(rec, sizeof(rec), "producer %d record %d", i, n);
+                if (shmring_push(other, rec, 16 + (uint32_t) (n % 7) * 8, (uint32_t) i) == 0) n++;
+            }
+            _exit(0);
+        }
+    }
+    (void) usleep(1000);
+    e = kill(pids[0], SIGKILL);
+    assert(e == 0);
+
+    n = 0;
+    for (i = 0; i < SHMRING_PRODUCERS; ) {
+        p = shmring_pop(ring, &len, &prio);
+        if (p != NULL) {
+            assert(prio < SHMRING_PRODUCERS && strprefix(p, "producer "));
+            free(p);
+            n++;
+            continue;
+        }
+        assert(errno == EAGAIN);
+        if (waitpid(-1, &status, WNOHANG) > 0) i++;
+    }
+    /* Whatever the killed one left half-done is skipped once it's gone */
+    for (i = 0, pushed = 0; i < 500; i++) {
+        p = shmring_pop(ring, &len, &prio);
+        if (p != NULL) {
+            e = strcmp(p, "after");
+            free(p);
+            if (e == 0) break;
+            n++;
+            continue;
+        }
+        if (!pushed) pushed = shmring_push(other, "after", 5, 0) == 0;
+        (void) usleep(10000);
+    }
+    assert(i < 500 && n >= (SHMRING_PRODUCERS - 1) * 2000);
+
+    shmring_close(other);
+    shmring_close(ring);
+    e = shm_unlink(name);
+    assert(e == 0);
+}
+
+static void relay_test(void)
+{
+    struct sockaddr_un sun;
+    relay_hdr_t hdr;
+    relay_t *relay;
+    char buf[256];
+    struct stat sb;
+    ssize_t n;
+    int lfd, fd, e;
+
+    /* Default socket lives in a directory private to us */
+    e = relay_default_path(buf, sizeof(buf));
+    assert(e == 0);
+    *strrchr(buf, '/') = '\0';
+    e = stat(buf, &sb);
+    assert(e == 0);
+    assert(S_ISDIR(sb.st_mode) && sb.st_uid == getuid() && (sb.st_mode & 0777) == 0700);
+
+    (void) memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    (void) snprintf(sun.sun_path, sizeof(sun.sun_path), "/tmp/csentry-relay-test-%d.sock", (int) getpid());
+    (void) unlink(sun.sun_path);
+
+    lfd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    assert(lfd >= 0);
+    e = bind(lfd, (struct sockaddr *) &sun, sizeof(sun));
+    assert(e == 0);
+    e = listen(lfd, 1);
+    assert(e == 0);
+
+    relay = relay_new(sun.sun_path);
+    assert_nonnull(relay);
+    e = relay_send(relay, "url", "auth", "{}", 2);
+    assert(e == 0);
+
+    fd = accept(lfd, NULL, NULL);
+    assert(fd >= 0);
+    n = recv(fd, buf, sizeof(buf), 0);
+    assert(n == (ssize_t) (sizeof(hdr) + 3 + 4 + 2));
+    (void) memcpy(&hdr, buf, sizeof(hdr));
+    assert(hdr.magic == RELAY_MAGIC && hdr.url_len == 3 && hdr.auth_len == 4 && hdr.body_len == 2);
+    assert(!memcmp(buf + sizeof(hdr), "urlauth{}", 9));
+
+    e = relay_send(relay, "url", "auth", buf, RELAY_MSG_MAX);
+    assert(e == -1 && errno == EMSGSIZE);
+
+    /* Relay gone, reconnection is throttled */
+    (void) close(fd);
+    (void) close(lfd);
+    (void) unlink(sun.sun_path);
+    e = relay_send(relay, "url", "auth", "{}", 2);
+    assert(e == -1);
+    assert(relay->fd < 0);
+    e = relay_send(relay, "url", "auth", "{}", 2);
+    assert(e == -1 && errno == ECONNREFUSED);
+
+    relay_free(relay);
+}
+
+static void udp_test(void)
+{
+    struct sockaddr_in sin;
+    socklen_t slen = sizeof(sin);
+    udp_datagram_t dgrams[3];
+    char addr[32];
+    char buf[512];
+    char *big, *p;
+    udp_t *udp;
+    size_t len;
+    ssize_t n;
+    int fd, i, e;
+
+    udp = udp_new("127.0.0.1");
+    assert(udp == NULL && errno == EINVAL);
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    assert(fd >= 0);
+    (void) memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    e = bind(fd, (struct sockaddr *) &sin, sizeof(sin));
+    assert(e == 0);
+    e = getsockname(fd, (struct sockaddr *) &sin, &slen);
+    assert(e == 0);
+
+    (void) snprintf(addr, sizeof(addr), "127.0.0.1:%d", ntohs(sin.sin_port));
+    udp = udp_new(addr);
+    assert_nonnull(udp);
+
+    for (i = 0; i < (int) ARRAY_SIZE(dgrams); i++) {
+        dgrams[i].buf = udp_encode("Sentry sentry_key=k", "{\"message\":\"udp\"}", 17, &dgrams[i].len);
+        assert(dgrams[i].buf != NULL && dgrams[i].len > 21);
+    }
+    e = udp_send(udp, dgrams, ARRAY_SIZE(dgrams));
+    assert(e == (int) ARRAY_SIZE(dgrams));
+
+    for (i = 0; i < (int) ARRAY_SIZE(dgrams); i++) {
+        n = recv(fd, buf, sizeof(buf), 0);
+        assert(n == (ssize_t) dgrams[i].len);
+        assert(!memcmp(buf, "Sentry sentry_key=k\n\n", 21));
+        free(dgrams[i].buf);
+    }
+
+    /* Incompressible events larger than a datagram are refused */
+    big = (char *) malloc(2 * UDP_DATAGRAM_MAX);
+    assert_nonnull(big);
+    for (i = 0; i < (int) (2 * UDP_DATAGRAM_MAX); i++) big[i] = (char) generate_rand(0, 255);
+    p = udp_encode("auth", big, 2 * UDP_DATAGRAM_MAX, &len);
+    assert(p == NULL && errno == EMSGSIZE);
+    free(big);
+
+    udp_free(udp);
+    (void) close(fd);
+}
+
+static void body_test(void)
+{
+    body_t body;
+    body_cursor_t cur;
+    char buf[16];
+    size_t n;
+    int e;
+
+    body_init(&body);
+    e = body_add(&body, "{\"a\":", 5);
+    assert(e == 0);
+    e = body_add(&body, "", 0);
+    assert(e == 0);
+    e = body_add(&body, "1}", 2);
+    assert(e == 0);
+    assert(body.n == 2 && body_size(&body) == 7);
+
+    /* Reads span segments */
+    body_cursor_init(&cur, &body);
+    n = body_read(&cur, buf, 3);
+    n += body_read(&cur, buf + n, sizeof(buf) - n);
+    assert(n == 7 && !memcmp(buf, "{\"a\":1}", 7));
+    n = body_read(&cur, buf, sizeof(buf));
+    assert(n == 0);
+
+    /* Rewound to the middle of a segment */
+    e = body_seek(&cur, 6);
+    assert(e == 0);
+    n = body_read(&cur, buf, sizeof(buf));
+    assert(n == 1 && buf[0] == '}');
+    e = body_seek(&cur, 0);
+    assert(e == 0);
+    n = body_read(&cur, buf, sizeof(buf));
+    assert(n == 7);
+    e = body_seek(&cur, 8);
+    assert(e != 0 && errno == EINVAL);
+
+    while (body.n < BODY_SEGS_MAX) {
+        e = body_add(&body, "x", 1);
+        assert(e == 0);
+    }
+    e = body_add(&body, "x", 1);
+    assert(e != 0 && errno == ENOSPC);
+}
+
+static void envelope_test(void)
+{
+    char path[] = "/tmp/csentry-envelope-XXXXXX";
+    attachment_t *atts[3];
+    envelope_t env;
+    body_cursor_t cur;
+    uuid_t u;
+    char *buf, *p;
+    size_t size = CSENTRY_ATTACHMENT_SIZE_MAX + 3;
+    attachment_t *att;
+    ssize_t n;
+    int fd, proc, e;
+
+    /* Larger than the cap, only its tail is sent */
+    fd = mkstemp(path);
+    assert(fd >= 0);
+    e = ftruncate(fd, (off_t) size - 3);
+    assert(e == 0);
+    n = pwrite(fd, "end", 3, (off_t) size - 3);
+    assert(n == 3);
+
+    atts[0] = attachment_new(path, -1, NULL, "text/plain");
+    /* Size of procfs files is unknown until read */
+    proc = open("/proc/self/stat", O_RDONLY);
+    assert(proc >= 0);
+    atts[1] = attachment_new(NULL, proc, "stat", NULL);
+    (void) close(proc);
+    atts[2] = attachment_new("/nonexistent/csentry.log", -1, NULL, NULL);
+    assert_nonnull(atts[0]);
+    assert_nonnull(atts[1]);
+    assert_nonnull(atts[2]);
+    att = attachment_new(path, fd, NULL, NULL);
+    assert(att == NULL && errno == EINVAL);
+    (void) close(fd);
+
+    /* Files are opened upon build, no longer needed by the path afterwards */
+    uuid_generate(u);
+    e = envelope_build(&env, u, "{}", 2, atts, 3);
+    assert(e == 0);
+    e = unlink(path);
+    assert(e == 0);
+    attachment_put(atts[0]);
+    attachment_put(atts[1]);
+    attachment_put(atts[2]);
+
+    buf = (char *) malloc(body_size(&env.body) + 1);
+    assert_nonnull(buf);
+    body_cursor_init(&cur, &env.body);
+    n = body_read(&cur, buf, body_size(&env.body));
+    assert(n == (ssize_t) body_size(&env.body));
+    buf[body_size(&env.body)] = '\0';
+
+    assert(strprefix(buf, "{\"event_id\":\""));
+    p = strstr(buf, "}\n{\"type\":\"event\",\"length\":2}\n{}\n");
+    assert_nonnull(p);
+    p = strstr(p, "{\"type\":\"attachment\",\"length\":1048576,\"filename\":\"csentry-envelope-");
+    assert_nonnull(p);
+    p = strchr(p, '\n') + 1 + CSENTRY_ATTACHMENT_SIZE_MAX;
+    assert(!memcmp(p - 3, "end", 3));
+    assert(strprefix(p, "\n{\"type\":\"attachment\",\"length\":"));
+    assert(strstr(p, "\"filename\":\"stat\",\"content_type\":\"application/octet-stream\"}\n") != NULL);
+    /* Missing file is skipped */
+    assert(strstr(p, "csentry.log") == NULL);
+
+    free(buf);
+    envelope_free(&env);
+}
+
+#define HTTP_TEST_REQS      3
+
+/* Serves HTTP_TEST_REQS requests, a connection for each, the last one is rejected */
+static void *http_test_server(void *arg)
+{
+    static const char resp[] = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\n{}";
+    static const char resp_err[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 12\r\nConnection: close\r\n\r\n{\"detail\":1}";
+    int lfd = *(int *) arg;
+    char buf[1024];
+    size_t len;
+    ssize_t n;
+    char *p;
+    int i, fd;
+
+    for (i = 0; i < HTTP_TEST_REQS; i++) {
+        fd = accept(lfd, NULL, NULL);
+        assert(fd >= 0);
+
+        len = 0;
+        do {
+            n = recv(fd, buf + len, sizeof(buf) - 1 - len, 0);
+            assert(n > 0);
+            len += (size_t) n;
+            buf[len] = '\0';
+            p = strstr(buf, "\r\n\r\n");
+        } while (p == NULL || strcmp(p + 4, "{}") != 0);
+
+        assert(strstr(buf, "X-Sentry-Auth: auth\r\n") != NULL);
+        if (i + 1 < HTTP_TEST_REQS) {
+            n = send(fd, resp, STRLEN(resp), 0);
+            assert(n == (ssize_t) STRLEN(resp));
+        } else {
+            n = send(fd, resp_err, STRLEN(resp_err), 0);
+            assert(n == (ssize_t) STRLEN(resp_err));
+        }
+        (void) close(fd);
+    }
+
+    return NULL;
+}
+
+static void http_test_done(void *arg, const http_result_t *res)
+{
+    assert(res->size == 2);
+    /* Reply body is only kept for diagnosis of errors */
+    if (res->status == 200) {
+        assert(res->reply == NULL);
+    } else {
+        assert(res->status == 400);
+        assert(res->reply != NULL && !strcmp(res->reply, "{\"detail\":1}"));
+    }
+    assert(res->udata == arg);
+    (*(int *) arg)++;
+}
+
+static void http_test(void)
+{
+    struct sockaddr_in sin;
+    socklen_t slen = sizeof(sin);
+    pthread_t thd;
+    char url[64];
+    http_t *http;
+    body_t body;
+    int lfd, i, e, done = 0;
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(lfd >= 0);
+    (void) memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    e = bind(lfd, (struct sockaddr *) &sin, sizeof(sin));
+    assert(e == 0);
+    e = listen(lfd, HTTP_TEST_REQS);
+    assert(e == 0);
+    e = getsockname(lfd, (struct sockaddr *) &sin, &slen);
+    assert(e == 0);
+    e = pthread_create(&thd, NULL, http_test_server, &lfd);
+    assert(e == 0);
+
+    (void) snprintf(url, sizeof(url), "http://127.0.0.1:%d/api/1/store/", ntohs(sin.sin_port));
+    http = http_new();
+    assert_nonnull(http);
+    /* Streamed from segments, shared by all requests */
+    body_init(&body);
+    e = body_add(&body, "{", 1);
+    assert(e == 0);
+    e = body_add(&body, "}", 1);
+    assert(e == 0);
+    for (i = 0; i < HTTP_TEST_REQS; i++) {
+        assert(http_ready(http));
+        e = http_submit(http, url, "X-Sentry-Auth: auth", "application/json", &body, &done);
+        assert(e == 0);
+    }
+    assert(http_inflight(http) == HTTP_TEST_REQS);
+
+    while (http_inflight(http) != 0) http_perform(http, 100, http_test_done, &done);
+    assert(done == HTTP_TEST_REQS);
+
+    e = pthread_join(thd, NULL);
+    assert(e == 0);
+    (void) close(lfd);
+    http_free(http);
+}
+
+#define DEADLINE_ANSWERS        2
+#define DEADLINE_CONNS          4
+
+typedef struct {
+    int lfd;
+    int stop;
+    int accepted;
+    int answered;               /* Requests answered, later ones hang */
+} deadline_server_t;
+
+/**
+ * @return      Body of the request read in whole  NULL if the peer is gone
+ */
+static char * _nullable deadline_server_recv(int fd, char *buf, size_t size)
+{
+    size_t len = 0;
+    ssize_t n;
+    char *p = NULL;
+
+    do {
+        n = recv(fd, buf + len, size - 1 - len, 0);
+        if (n <= 0) return NULL;
+        len += (size_t) n;
+        buf[len] = '\0';
+        if (p == NULL) p = strstr(buf, "\r\n\r\n");
+    } while (p == NULL || len - (size_t) (p + 4 - buf) <
+                strtoul(strstr(buf, "Content-Length:") + STRLEN("Content-Length:"), NULL, 10));
+
+    return p + 4;
+}
+
+/* Answers the first requests, then leaves further ones unanswered until stopped */
+static void *exception_deadline_server(void *arg)
+{
+    static const char resp[] = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\n{}";
+    deadline_server_t *srv = (deadline_server_t *) arg;
+    struct pollfd pfds[1 + DEADLINE_CONNS];
+    char buf[65536];
+    nfds_t i, nfds = 1;
+    ssize_t n;
+    char *p;
+    int fd;
+
+    pfds[0].fd = srv->lfd;
+    pfds[0].events = POLLIN;
+
+    while (!__atomic_load_n(&srv->stop, __ATOMIC_SEQ_CST)) {
+        if (poll(pfds, nfds, 10) <= 0) continue;
+
+        if ((pfds[0].revents & POLLIN) && nfds < ARRAY_SIZE(pfds)) {
+            fd = accept(srv->lfd, NULL, NULL);
+            assert(fd >= 0);
+            pfds[nfds].fd = fd;
+            pfds[nfds].events = POLLIN;
+            pfds[nfds].revents = 0;
+            nfds++;
+            (void) __atomic_add_fetch(&srv->accepted, 1, __ATOMIC_SEQ_CST);
+        }
+
+        for (i = 1; i < nfds; i++) {
+            if (pfds[i].fd < 0 || pfds[i].revents == 0) continue;
+
+            p = deadline_server_recv(pfds[i].fd, buf, sizeof(buf));
+            if (p == NULL) {
+                (void) close(pfds[i].fd);
+                pfds[i].fd = -1;
+            } else if (__atomic_load_n(&srv->answered, __ATOMIC_SEQ_CST) < DEADLINE_ANSWERS) {
+                assert(strstr(p, "fatal") != NULL);
+                (void) __atomic_add_fetch(&srv->answered, 1, __ATOMIC_SEQ_CST);
+                n = send(pfds[i].fd, resp, STRLEN(resp), 0);
+                assert(n == (ssize_t) STRLEN(resp));
+            } else {
+                /* Kept open but never read again, the client's request hangs */
+                pfds[i].events = 0;
+            }
+        }
+    }
+
+    for (i = 0; i < nfds; i++) {
+        if (pfds[i].fd >= 0) (void) close(pfds[i].fd);
+    }
+    return NULL;
+}
+
+static void exception_deadline_test(void)
+{
+    struct sockaddr_in sin;
+    socklen_t slen = sizeof(sin);
+    deadline_server_t srv = {0};
+    csentry_stats_t st;
+    pthread_t thd;
+    char dsn[64];
+    const char *id;
+    uint64_t t;
+    void *handle;
+    int i, e;
+
+    srv.lfd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(srv.lfd >= 0);
+    (void) memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    e = bind(srv.lfd, (struct sockaddr *) &sin, sizeof(sin));
+    assert(e == 0);
+    e = listen(srv.lfd, DEADLINE_CONNS);
+    assert(e == 0);
+    e = getsockname(srv.lfd, (struct sockaddr *) &sin, &slen);
+    assert(e == 0);
+    e = pthread_create(&thd, NULL, exception_deadline_server, &srv);
+    assert(e == 0);
+
+    (void) snprintf(dsn, sizeof(dsn), "http://eeadde0381684a339597770ce54b4c66@127.0.0.1:%d/1", ntohs(sin.sin_port));
+    handle = csentry_new(dsn, NULL, 1.0f, 0);
+    assert_nonnull(handle);
+    csentry_set_http_timeouts(handle, 100, 200);
+    csentry_set_exception_deadline(handle, 2000);
+
+    /* Accepted by the server once returned, over a single connection */
+    id = csentry_capture_exception(handle, "Sent right away");
+    assert_nonnull(id);
+    id = csentry_capture_exception(handle, "Sent right away again");
+    assert_nonnull(id);
+    assert(__atomic_load_n(&srv.answered, __ATOMIC_SEQ_CST) == 2);
+    assert(__atomic_load_n(&srv.accepted, __ATOMIC_SEQ_CST) == 1);
+    csentry_get_stats(handle, &st);
+    assert(st.captured == 2 && st.sent == 2);
+
+    /* Unanswered, queued once the deadline passed */
+    csentry_set_exception_deadline(handle, 100);
+    t = monotonic_ns();
+    id = csentry_capture_exception(handle, "Queued");
+    assert_nonnull(id);
+    t = monotonic_ns() - t;
+    assert(t >= 100000000ull && t < 1000000000ull);
+    csentry_get_stats(handle, &st);
+    assert(st.captured == 3 && st.sent == 2);
+
+    /* The worker's POST hangs as well and fails on timeout */
+    for (i = 0; i < 500; i++) {
+        csentry_get_stats(handle, &st);
+        if (st.failed != 0) break;
+        (void) usleep(10000);
+    }
+    assert(st.failed == 1 && st.sent == 2);
+
+    csentry_destroy(handle);
+    __atomic_store_n(&srv.stop, 1, __ATOMIC_SEQ_CST);
+    e = pthread_join(thd, NULL);
+    assert(e == 0);
+}
+
+/**
+ * Bytes in flight are accounted by the whole envelope, attachments incl.
+ */
+static void envelope_inflight_test(void)
+{
+    struct sockaddr_in sin;
+    socklen_t slen = sizeof(sin);
+    deadline_server_t srv = {0};
+    char path[] = "/tmp/csentry-inflight-XXXXXX";
+    char buf[8192];
+    csentry_stats_t st;
+    pthread_t thd;
+    char dsn[64];
+    const char *id;
+    void *handle;
+    ssize_t n;
+    int i, fd, e;
+
+    srv.lfd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(srv.lfd >= 0);
+    (void) memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    e = bind(srv.lfd, (struct sockaddr *) &sin, sizeof(sin));
+    assert(e == 0);
+    e = listen(srv.lfd, DEADLINE_CONNS);
+    assert(e == 0);
+    e = getsockname(srv.lfd, (struct sockaddr *) &sin, &slen);
+    assert(e == 0);
+    e = pthread_create(&thd, NULL, exception_deadline_server, &srv);
+    assert(e == 0);
+
+    fd = mkstemp(path);
+    assert(fd >= 0);
+    (void) memset(buf, 'x', sizeof(buf));
+    n = write(fd, buf, sizeof(buf));
+    assert(n == (ssize_t) sizeof(buf));
+    (void) close(fd);
+
+    (void) snprintf(dsn, sizeof(dsn), "http://eeadde0381684a339597770ce54b4c66@127.0.0.1:%d/1", ntohs(sin.sin_port));
+    handle = csentry_new(dsn, NULL, 1.0f, 0);
+    assert_nonnull(handle);
+    e = csentry_add_attachment(handle, path, "text/plain");
+    assert(e == 0);
+
+    id = csentry_capture_message(handle, CSENTRY_LEVEL_FATAL, "Fatal with attachment");
+    assert_nonnull(id);
+    for (i = 0; i < 500; i++) {
+        csentry_get_stats(handle, &st);
+        if (st.sent != 0) break;
+        (void) usleep(10000);
+    }
+    assert(st.sent == 1 && st.bytes_sent > sizeof(buf));
+    assert(st.http_inflight_bytes == 0);
+
+    csentry_destroy(handle);
+    __atomic_store_n(&srv.stop, 1, __ATOMIC_SEQ_CST);
+    e = pthread_join(thd, NULL);
+    assert(e == 0);
+    (void) unlink(path);
+}
+
+/**
+ * Worker of the parent doesn't survive fork(2), the child starts its own
+ */
+static void fork_test(void)
+{
+    csentry_stats_t st;
+    void *handle;
+    pid_t pid;
+    int i, status, e;
+
+    /* Nothing listens on port 1, POSTs fail fast */
+    handle = csentry_new("http://eeadde0381684a339597770ce54b4c66@127.0.0.1:1/1", NULL, 1.0f, 0);
+    assert_nonnull(handle);
+
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        handle = csentry_new("http://eeadde0381684a339597770ce54b4c66@127.0.0.1:1/1", NULL, 1.0f, 0);
+        if (handle == NULL) _exit(1);
+        if (csentry_capture_message(handle, CSENTRY_LEVEL_INFO, "From child") == NULL) _exit(1);
+        for (i = 0; i < 500; i++) {
+            csentry_get_stats(handle, &st);
+            if (st.sent + st.failed != 0) _exit(0);
+            (void) usleep(10000);
+        }
+        _exit(2);
+    }
+
+    e = waitpid(pid, &status, 0);
+    assert(e == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    csentry_destroy(handle);
+}
+
+static void ratelimit_test(void)
+{
+    static ratelimit_t rl;
+    uint32_t suppressed;
+    int i, n = 0;
+    void *handle;
+    int e;
+
+    ratelimit_init(&rl);
+    /* Disabled limiter always pass */
+    e = ratelimit_acquire(&rl, 1, &suppressed);
+    assert(e && suppressed == 0);
+
+    ratelimit_set(&rl, 10.0, 3);
+    for (i = 0; i < 100; i++) {
+        n += ratelimit_acquire(&rl, 2, &suppressed);
+    }
+    assert(n == 3);
+
+    /* Other call sites have their own bucket */
+    e = ratelimit_acquire(&rl, 3, &suppressed);
+    assert(e);
+
+    (void) usleep(200000);
+    e = ratelimit_acquire(&rl, 2, &suppressed);
+    assert(e);
+    assert(suppressed == 97);
+
+    /* Idle call sites give way once the table is full */
+    for (i = 0; i < (int) RATELIMIT_SLOTS; i++) {
+        e = ratelimit_acquire(&rl, 100 + i, &suppressed);
+        assert(e);
+    }
+    (void) usleep(400000);
+    for (i = 0, n = 0; i < 100; i++) {
+        n += ratelimit_acquire(&rl, 1000, &suppressed);
+    }
+    assert(n == 3);
+
+    handle = csentry_new("https://eeadde0381684a339597770ce54b4c66@sentry.io/1489851", NULL, 1.0f, 0);
+    assert_nonnull(handle);
+    e = csentry_set_rate_limit(handle, -1.0f, 1);
+    assert(e == -1 && errno == EINVAL);
+    e = csentry_set_rate_limit(handle, NAN, 1);
+    assert(e == -1 && errno == EINVAL);
+    e = csentry_set_rate_limit(handle, 0.5f, 5);
+    assert(e == 0);
+    csentry_destroy(handle);
+}
+
+static void coalesce_test(void)
+{
+    void *handle;
+    const char *id;
+    uuid_string_t info;
+    uuid_string_t warn;
+    csentry_stats_t st;
+    int i;
+
+    /* Nothing listens on port 1, POSTs fail fast */
+    handle = csentry_new("http://eeadde0381684a339597770ce54b4c66@127.0.0.1:1/1", NULL, 1.0f, 0);
+    assert_nonnull(handle);
+
+    /* Window outlives the test, so held events stay queued */
+    csentry_set_coalesce_window(handle, 60000);
+
+    /* Should be queued as two events, each with occurrences 1000 */
+    for (i = 0; i < 1000; i++) {
+        id = csentry_capture_message(handle, CSENTRY_LEVEL_INFO, "Coalesced info");
+        assert_nonnull(id);
+        if (i == 0) (void) strcpy(info, id);
+        assert(!strcmp(id, info));
+
+        id = csentry_capture_message(handle, CSENTRY_LEVEL_WARN, "Coalesced warning");
+        assert_nonnull(id);
+        if (i == 0) (void) strcpy(warn, id);
+        assert(!strcmp(id, warn));
+    }
+    assert(strcmp(info, warn));
+
+    /* Held events are bounded apart from the backlog */
+    for (i = 0; i < 100; i++) {
+        id = csentry_capture_message(handle, CSENTRY_LEVEL_WARN, "Distinct warning %d", i);
+        assert_nonnull(id);
+    }
+
+    csentry_get_stats(handle, &st);
+    assert(st.captured == 102 && st.coalesced == 1998 && st.queue_dropped == 0);
+
+    /* Urgent events are never held */
+    id = csentry_capture_exception(handle, "Not held");
+    assert_nonnull(id);
+    for (i = 0; i < 500; i++) {
+        csentry_get_stats(handle, &st);
+        if (st.failed != 0) break;
+        (void) usleep(10000);
+    }
+    assert(st.failed == 1 && st.sent == 0);
+
+    csentry_debug(handle);
+
+    csentry_destroy(handle);
+}
+
+static void symbolize_test(void)
+{
+    symbol_t sym;
+    uint64_t hits, misses, hits2, misses2;
+    void *pcs[2] = {(void *) &symbolize_test, (void *) &strlen};
+    char *bt;
+
+    symbol_cache_stats(&hits, &misses);
+    symbolize(pcs[1], &sym);
+    assert(sym.addr == pcs[1]);
+    LOG("%p  module: %s name: %s", sym.addr, sym.module, sym.name);
+
+    /* Second lookup should hit the cache */
+    symbolize(pcs[1], &sym);
+    symbol_cache_stats(&hits2, &misses2);
+    assert(hits2 == hits + 1 && misses2 == misses + 1);
+
+    bt = symbolize_backtrace(pcs, ARRAY_SIZE(pcs));
+    assert_nonnull(bt);
+    LOG("backtrace:\n%s", bt);
+    free(bt);
+
+    symbol_cache_flush();
+}
+
+static void modules_test(void)
+{
+    module_t mod;
+    cJSON *json;
+    char *str;
+    int e;
+
+    if (modules_refresh() != 0) return;     /* Not supported */
+
+    e = modules_find((uintptr_t) &modules_test, &mod);
+    assert(e);
+    assert((uintptr_t) &modules_test - mod.addr < mod.size);
+
+    json = module_to_json(&mod);
+    assert_nonnull(json);
+    str = cJSON_Print(json);
+    LOG("main image: %s", str);
+    free(str);
+    cJSON_Delete(json);
+
+    /* No change since last refresh */
+    e = modules_refresh();
+    assert(e == 0);
+}
+
+static void unwind_test(void)
+{
+    void *pcs[16];
+    void *handle;
+    unwind_fn fn;
+    uint32_t n;
+
+    fn = unwinder_get(UNWINDER_BACKTRACE);
+    assert_nonnull(fn);
+    n = fn(pcs, ARRAY_SIZE(pcs));
+    assert(n > 0 && n <= ARRAY_SIZE(pcs));
+
+    handle = csentry_new("https://eeadde0381684a339597770ce54b4c66@sentry.io/1489851", NULL, 1.0f,
+                CSENTRY_INIT_UNWIND_FP | CSENTRY_INIT_UNWIND_LIBUNWIND);
+    assert(handle == NULL && errno == ENOTSUP);
+
+    if (unwinder_get(UNWINDER_FP) != NULL) {
+        handle = csentry_new("https://eeadde0381684a339597770ce54b4c66@sentry.io/1489851", NULL, 1.0f,
+                    CSENTRY_INIT_UNWIND_FP);
+        assert_nonnull(handle);
+        csentry_destroy(handle);
+    }
+}
+
+static void crash_test(void)
+{
+    char path[] = "/tmp/csentry-test-XXXXXX" CRASH_SPOOL_SUFFIX;
+    char link[] = "/tmp/csentry-test-link" CRASH_SPOOL_SUFFIX;
+    crash_record_t rec;
+    FILE *fp;
+    pid_t pid;
+    int fd, st, e;
+
+    fd = mkstemps(path, STRLEN(CRASH_SPOOL_SUFFIX));
+    assert(fd >= 0);
+    (void) close(fd);
+
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        if (crash_install(path, "{\"level\":\"fatal\"}", unwinder_get(UNWINDER_BACKTRACE)) != 0) _exit(1);
+        (void) raise(SIGABRT);
+        _exit(1);
+    }
+
+    e = waitpid(pid, &st, 0);
+    assert(e == pid);
+    assert(WIFSIGNALED(st) && WTERMSIG(st) == SIGABRT);
+
+    e = crash_record_load(path, &rec);
+    assert(e == 0);
+    assert(rec.signo == SIGABRT);
+    assert(rec.pid == pid);
+    assert(rec.nframes > 0);
+    assert(rec.context != NULL && !strcmp(rec.context, "{\"level\":\"fatal\"}"));
+    assert(!strcmp(crash_signal_name(rec.signo), "SIGABRT"));
+    crash_record_free(&rec);
+
+    /* Records written by crash helper carry stacks of other threads */
+    fp = fopen(path, "w");
+    assert_nonnull(fp);
+    (void) fputs(CRASH_RECORD_MAGIC "\nsignal=11\ntid=100\npc=0x10\npc=0x20\n"
+                 "thread=101\npc=0x30\nthread=102\ncontext=\n{}", fp);
+    (void) fclose(fp);
+
+    e = crash_record_load(path, &rec);
+    assert(e == 0);
+    assert(rec.tid == 100 && rec.nframes == 2 && rec.frames[1] == 0x20);
+    assert(rec.nthreads == 2);
+    assert(rec.threads[0].tid == 101 && rec.threads[0].nframes == 1 && rec.threads[0].frames[0] == 0x30);
+    assert(rec.threads[1].tid == 102 && rec.threads[1].nframes == 0);
+    crash_record_free(&rec);
+
+    /* Records are never read through a symlink */
+    (void) unlink(link);
+    e = symlink(path, link);
+    assert(e == 0);
+    e = crash_record_load(link, &rec);
+    assert(e == -1 && errno == ELOOP);
+    (void) unlink(link);
+
+    (void) unlink(path);
+}
+
+#define CRASH_CONTEXT_SETTERS   4
+
+static void *crash_context_setter(void *arg)
+{
+    char buf[32];
+    int i, e;
+
+    for (i = 0; i < 1000; i++) {
+        (void) snprintf(buf, sizeof(buf), "{\"setter\":%d}", i);
+        e = crash_set_context(buf);
+        assert(e == 0);
+    }
+
+    UNUSED(arg);
+    return NULL;
+}
+
+/**
+ * Context setters may race, e.g. csentry_ctx_clear() from many threads
+ */
+static void crash_context_test(void)
+{
+    pthread_t t[CRASH_CONTEXT_SETTERS];
+    int i, e;
+
+    for (i = 0; i < CRASH_CONTEXT_SETTERS; i++) {
+        e = pthread_create(&t[i], NULL, crash_context_setter, NULL);
+        assert(e == 0);
+    }
+    for (i = 0; i < CRASH_CONTEXT_SETTERS; i++) {
+        e = pthread_join(t[i], NULL);
+        assert(e == 0);
+    }
+}
+
+#define CRASH_SPOOL_DSN         "http://eeadde0381684a339597770ce54b4c66@127.0.0.1:1/1"
+#define CRASH_SPOOL_REPLAYERS   4
+
+/**
+ * Assert a spool directory holds a single file
+ * @path        [OUT] Path of the file
+ */
+static void crash_spool_only(const char *dir, const char *suffix, char *path, size_t size)
+{
+    struct dirent *ent;
+    DIR *d;
+    size_t n;
+    int count = 0;
+
+    d = opendir(dir);
+    assert_nonnull(d);
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.') continue;
+        n = strlen(ent->d_name);
+        assert(n > strlen(suffix) && !strcmp(ent->d_name + n - strlen(suffix), suffix));
+        (void) snprintf(path, size, "%s/%s", dir, ent->d_name);
+        count++;
+    }
+    (void) closedir(d);
+    assert(count == 1);
+}
+
+/**
+ * Start clients in children racing over the spool
+ * @return      Count of crash records replayed by them
+ */
+static int crash_spool_replay(int nprocs)
+{
+    csentry_stats_t st;
+    pid_t pids[CRASH_SPOOL_REPLAYERS];
+    void *handle;
+    int i, j, status, e, n = 0;
+
+    assert(nprocs <= CRASH_SPOOL_REPLAYERS);
+
+    for (i = 0; i < nprocs; i++) {
+        pids[i] = fork();
+        assert(pids[i] >= 0);
+        if (pids[i] == 0) {
+            /* Nothing listens on port 1, POSTs fail fast and records stay */
+            handle = csentry_new(CRASH_SPOOL_DSN, NULL, 1.0f, 0);
+            if (handle == NULL) _exit(255);
+            for (j = 0; j < 100; j++) {
+                csentry_get_stats(handle, &st);
+                if (st.sent + st.failed != 0) break;
+                (void) usleep(10000);
+            }
+            csentry_destroy(handle);
+            _exit((int) st.retried);
+        }
+    }
+
+    for (i = 0; i < nprocs; i++) {
+        e = waitpid(pids[i], &status, 0);
+        assert(e == pids[i] && WIFEXITED(status));
+        n += WEXITSTATUS(status);
+    }
+
+    return n;
+}
+
+/**
+ * Crash a child of a client, its record must land in a private spool directory
+ *  and be replayed once among clients sharing the spool
+ */
+static void crash_spool_test(uint32_t flags)
+{
+    char dir[] = "/tmp/csentry-spool-XXXXXX";
+    char path[PATH_MAX];
+    crash_record_t rec;
+    struct stat sb;
+    void *handle;
+    char *p;
+    pid_t pid;
+    int st, e;
+
+    p = mkdtemp(dir);
+    assert_nonnull(p);
+    e = setenv("CSENTRY_SPOOL_DIR", dir, 1);
+    assert(e == 0);
+
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        handle = csentry_new(CRASH_SPOOL_DSN, NULL, 1.0f, flags);
+        if (handle == NULL) _exit(1);
+        (void) raise(SIGABRT);
+        _exit(1);
+    }
+
+    e = waitpid(pid, &st, 0);
+    assert(e == pid);
+    assert(WIFSIGNALED(st) && WTERMSIG(st) == SIGABRT);
+
+    /* Renamed into place once complete */
+    crash_spool_only(dir, CRASH_SPOOL_SUFFIX, path, sizeof(path));
+    e = stat(path, &sb);
+    assert(e == 0);
+    assert(sb.st_uid == getuid() && (sb.st_mode & 0777) == 0600);
+
+    e = crash_record_load(path, &rec);
+    assert(e == 0);
+    assert(rec.signo == SIGABRT && rec.pid == pid);
+    crash_record_free(&rec);
+
+    /* Claimed by one of them, kept since the POST failed */
+    e = crash_spool_replay(CRASH_SPOOL_REPLAYERS);
+    assert(e == 1);
+    crash_spool_only(dir, CRASH_CLAIM_SUFFIX, path, sizeof(path));
+
+    /* Its claimer is gone, so it's taken over */
+    e = crash_spool_replay(1);
+    assert(e == 1);
+    crash_spool_only(dir, CRASH_CLAIM_SUFFIX, path, sizeof(path));
+    e = crash_record_load(path, &rec);
+    assert(e == 0);
+    assert(rec.signo == SIGABRT && rec.pid == pid);
+    crash_record_free(&rec);
+
+    (void) unlink(path);
+    (void) rmdir(dir);
+    (void) unsetenv("CSENTRY_SPOOL_DIR");
+}
+
+static volatile int threads_test_stop = 0;
+
+static void *threads_test_worker(void *arg)
+{
+    UNUSED(arg);
+    while (!threads_test_stop) (void) usleep(1000);
+    return NULL;
+}
+
+static void threads_test(void)
+{
+    pthread_t t[2];
+    thread_stack_t stacks[8];
+    int i, n, e;
+
+    for (i = 0; i < 2; i++) {
+        e = pthread_create(&t[i], NULL, threads_test_worker, NULL);
+        assert(e == 0);
+    }
+
+    n = threads_capture(unwinder_get(UNWINDER_BACKTRACE), stacks, ARRAY_SIZE(stacks), 1000);
+    if (n < 0) {
+        assert(errno == ENOTSUP);
+    } else {
+        /* Calling thread is never included */
+        assert(n >= 2);
+        for (i = 0; i < n; i++) {
+            assert(stacks[i].tid != threads_current_tid());
+            assert(stacks[i].nframes > 0);
+        }
+    }
+
+    threads_test_stop = 1;
+    for (i = 0; i < 2; i++) {
+        e = pthread_join(t[i], NULL);
+        assert(e == 0);
+    }
+}
+
 int main(void)
 {
     LOG_DBG("Debug build");
@@ -236,6 +1667,35 @@ int main(void)
     UNUSED(breadcrumb_test_v2);
     //breadcrumb_test_v2();
 
+    coalesce_test();
+
+    rand_test();
+    sample_rate_test();
+    event_id_test();
+    ctx_snapshot_test();
+    stats_test();
+    shmring_test();
+    relay_test();
+    udp_test();
+    body_test();
+    envelope_test();
+    http_test();
+    exception_deadline_test();
+    envelope_inflight_test();
+    fork_test();
+    ratelimit_test();
+    symbolize_test();
+    modules_test();
+    unwind_test();
+    crash_test();
+    crash_context_test();
+    crash_spool_test(CSENTRY_INIT_INSTALL_HANDLERS);
+#ifdef CRASH_HELPER_PATH
+    /* Record written by the helper instead */
+    crash_spool_test(CSENTRY_INIT_CRASH_HELPER);
+#endif
+    threads_test();
+
     LOG("Pass!");
     return 0;
 }
@@ -0,0 +1,296 @@
+/*
+ * Created 191025 lynnl
+ *
+ * Out-of-process crash helper, launched by crash_helper_start()
+ *  usage: csentry-crash-helper PID FD SPOOL_PATH
+ *
+ * Upon a crash message it stops every thread of the crashed process
+ *  via ptrace(2), walks their frame pointer chains through
+ *  process_vm_readv(2) and writes the spool record on its behalf
+ * Nothing is read from the crashed heap, context is pushed beforehand
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <elf.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+
+#include "../src/log.h"
+#include "../src/utils.h"
+#include "../src/crash.h"
+
+#define HELPER_MAX_THREADS      256
+
+typedef struct {
+    long tid;
+    uint32_t nframes;
+    uintptr_t frames[CRASH_MAX_FRAMES];
+} helper_thread_t;
+
+/**
+ * @return      0 if whole range read  -1 o.w.
+ */
+static int remote_read(pid_t pid, uintptr_t addr, void *buf, size_t size)
+{
+    struct iovec local = {buf, size};
+    struct iovec remote = {(void *) addr, size};
+    return process_vm_readv(pid, &local, 1, &remote, 1, 0) == (ssize_t) size ? 0 : -1;
+}
+
+/**
+ * Walk frame pointer chain of a remote thread
+ * Each frame record is a pair of {saved frame pointer, return address}
+ *  on both x86_64 and aarch64
+ */
+static uint32_t remote_walk(
+        pid_t pid,
+        uintptr_t pc,
+        uintptr_t fp,
+        uintptr_t *frames,
+        uint32_t size)
+{
+    uintptr_t rec[2];
+    uint32_t n = 0;
+
+    if (pc != 0 && n < size) frames[n++] = pc;
+
+    while (n < size && fp != 0 && (fp & (sizeof(uintptr_t) - 1)) == 0) {
+        if (remote_read(pid, fp, rec, sizeof(rec)) != 0 || rec[1] == 0) break;
+        frames[n++] = rec[1];
+        /* Stack grows down, a sane chain always goes up */
+        if (rec[0] <= fp) break;
+        fp = rec[0];
+    }
+
+    return n;
+}
+
+/**
+ * @return      0 if success  -1 o.w.(unsupported architecture included)
+ */
+static int thread_regs(long tid, uintptr_t *pc, uintptr_t *fp)
+{
+#if defined(__x86_64__) || defined(__aarch64__)
+    struct user_regs_struct regs;
+    struct iovec iov = {&regs, sizeof(regs)};
+
+    if (ptrace(PTRACE_GETREGSET, (pid_t) tid, (void *) NT_PRSTATUS, &iov) != 0) return -1;
+#if defined(__x86_64__)
+    *pc = (uintptr_t) regs.rip;
+    *fp = (uintptr_t) regs.rbp;
+#else
+    *pc = (uintptr_t) regs.pc;
+    *fp = (uintptr_t) regs.regs[29];
+#endif
+    return 0;
+#else
+    UNUSED(tid, pc, fp);
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+/**
+ * Stop a thread without signaling the tracee(PTRACE_SEIZE + PTRACE_INTERRUPT)
+ * @return      0 if stopped  -1 o.w.
+ */
+static int thread_stop(long tid)
+{
+    int st;
+
+    if (ptrace(PTRACE_SEIZE, (pid_t) tid, NULL, NULL) != 0) return -1;
+    if (ptrace(PTRACE_INTERRUPT, (pid_t) tid, NULL, NULL) != 0 ||
+            waitpid((pid_t) tid, &st, __WALL) != (pid_t) tid || !WIFSTOPPED(st)) {
+        (void) ptrace(PTRACE_DETACH, (pid_t) tid, NULL, NULL);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Collect stacks of all threads but the crashing one
+ * The crashing thread is parked in its signal handler waiting for us
+ * @return      Number of threads collected
+ */
+static uint32_t collect_threads(pid_t pid, long crashed, helper_thread_t *threads, uint32_t size)
+{
+    char path[64];
+    DIR *dir;
+    struct dirent *ent;
+    long long tid;
+    uintptr_t pc, fp;
+    uint32_t i, n = 0;
+
+    (void) snprintf(path, sizeof(path), "/proc/%d/task", (int) pid);
+    dir = opendir(path);
+    if (dir == NULL) return 0;
+
+    while (n < size && (ent = readdir(dir)) != NULL) {
+        if (!parse_llong(ent->d_name, '\0', 10, &tid) || tid == crashed) continue;
+        if (thread_stop((long) tid) != 0) continue;
+        threads[n++].tid = (long) tid;
+    }
+    (void) closedir(dir);
+
+    /* Walk only after all threads stopped, so stacks are consistent */
+    for (i = 0; i < n; i++) {
+        threads[i].nframes = 0;
+        if (thread_regs(threads[i].tid, &pc, &fp) == 0) {
+            threads[i].nframes = remote_walk(pid, pc, fp,
+                                    threads[i].frames, CRASH_MAX_FRAMES);
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        (void) ptrace(PTRACE_DETACH, (pid_t) threads[i].tid, NULL, NULL);
+    }
+
+    return n;
+}
+
+static void put_frames(FILE *fp, const uintptr_t *frames, uint32_t n)
+{
+    uint32_t i;
+    for (i = 0; i < n; i++) {
+        (void) fprintf(fp, "pc=%#lx\n", (unsigned long) frames[i]);
+    }
+}
+
+/**
+ * Write a spool record, same format as the in-process handler's
+ */
+static int write_record(
+        const char *path,
+        pid_t pid,
+        const crash_helper_msg_t *msg,
+        const helper_thread_t *threads,
+        uint32_t nthreads,
+        const char * _nullable context)
+{
+    uintptr_t frames[CRASH_MAX_FRAMES];
+    char tmp[PATH_MAX];
+    uint32_t i, n;
+    FILE *fp;
+    int fd;
+
+    if ((size_t) snprintf(tmp, sizeof(tmp), "%s%s", path, CRASH_TMP_SUFFIX) >= sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    /* Stale file of a recycled pid is replaced, never written through a symlink */
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        (void) unlink(tmp);
+        fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    }
+    if (fd < 0) return -1;
+
+    fp = fdopen(fd, "w");
+    if (fp == NULL) {
+        (void) close(fd);
+        return -1;
+    }
+
+    (void) fprintf(fp, CRASH_RECORD_MAGIC "\n"
+                    "signal=%d\ncode=%d\naddr=%#lx\npid=%d\ntid=%ld\ntime=%ld\n",
+                    msg->signo, msg->code, (unsigned long) msg->addr,
+                    (int) pid, msg->tid, (long) time(NULL));
+
+    n = remote_walk(pid, msg->pc, msg->fp, frames, ARRAY_SIZE(frames));
+    put_frames(fp, frames, n);
+
+    for (i = 0; i < nthreads; i++) {
+        (void) fprintf(fp, "thread=%ld\n", threads[i].tid);
+        put_frames(fp, threads[i].frames, threads[i].nframes);
+    }
+
+    (void) fprintf(fp, "context=\n%s", context != NULL ? context : "");
+
+    (void) fflush(fp);
+    (void) fsync(fileno(fp));
+    if (fclose(fp) != 0) goto out_unlink;
+
+    /* Replay never sees a partial record */
+    if (rename(tmp, path) != 0) goto out_unlink;
+    return 0;
+
+out_unlink:
+    (void) unlink(tmp);
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    static helper_thread_t threads[HELPER_MAX_THREADS];
+    long long pid, fd;
+    const char *path;
+    char *buf;
+    char *context = NULL;
+    char c;
+    ssize_t n;
+    uint32_t nthreads;
+    crash_helper_msg_t msg;
+
+    if (argc != 4 || !parse_llong(argv[1], '\0', 10, &pid) ||
+            !parse_llong(argv[2], '\0', 10, &fd)) {
+        LOG_ERR("usage: %s PID FD SPOOL_PATH", argv[0]);
+        return 1;
+    }
+    path = argv[3];
+
+    /* Terminal signals are meant for the client, we exit along with it */
+    (void) signal(SIGINT, SIG_IGN);
+    (void) signal(SIGQUIT, SIG_IGN);
+    (void) signal(SIGPIPE, SIG_IGN);
+
+    buf = (char *) malloc(CRASH_HELPER_MSG_MAX + 1);
+    if (buf == NULL) return 1;
+
+    c = CRASH_HELPER_READY;
+    if (send((int) fd, &c, 1, 0) != 1) return 1;
+
+    for (;;) {
+        n = recv((int) fd, buf, CRASH_HELPER_MSG_MAX + 1, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;      /* Client gone */
+
+        if (buf[0] == CRASH_HELPER_CONTEXT) {
+            if ((size_t) n > CRASH_HELPER_MSG_MAX) {
+                LOG_WARN("Context too large  size: %zd", n);
+                continue;
+            }
+            free(context);
+            context = strndup(buf + 1, (size_t) n - 1);
+        } else if (buf[0] == CRASH_HELPER_CRASH && (size_t) n == sizeof(msg)) {
+            (void) memcpy(&msg, buf, sizeof(msg));
+            nthreads = collect_threads((pid_t) pid, msg.tid, threads, ARRAY_SIZE(threads));
+            if (write_record(path, (pid_t) pid, &msg, threads, nthreads, context) != 0) {
+                LOG_ERR("Cannot write crash record %s  errno: %d", path, errno);
+                continue;
+            }
+            c = CRASH_HELPER_DONE;
+            (void) send((int) fd, &c, 1, 0);
+        }
+    }
+
+    free(context);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,226 @@
+/*
+ * Created 191030 lynnl
+ *
+ * Reference relay daemon of CSENTRY_INIT_RELAY clients
+ *  usage: csentry-relay [SOCKET_PATH]
+ * Socket defaults to RELAY_DEFAULT_NAME in the per-user runtime directory
+ *  only clients of the same user(or root) are served
+ *
+ * Single-threaded: one event is POSTed at a time, a slow server
+ *  backs pressure up to clients through socket buffers
+ * Also serves as a stand-in of Sentry server in tests
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "../src/log.h"
+#include "../src/utils.h"
+#include "../src/curl_ez.h"
+#include "../src/relay.h"
+
+#define RELAY_MAX_CLIENTS       256
+
+static volatile sig_atomic_t relay_stop = 0;
+
+static void relay_on_signal(int signo)
+{
+    UNUSED(signo);
+    relay_stop = 1;
+}
+
+/**
+ * @return      Listening socket  -1 o.w.(errno will be set)
+ */
+static int relay_listen(const char *path)
+{
+    struct sockaddr_un sun;
+    mode_t mask;
+    int fd, e;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    (void) memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    (void) strcpy(sun.sun_path, path);
+
+    /* Socket left by a previous run */
+    (void) unlink(path);
+    /* Connecting needs write permission, keep others out from the start */
+    mask = umask(077);
+    e = bind(fd, (struct sockaddr *) &sun, sizeof(sun));
+    (void) umask(mask);
+    if (e != 0 || listen(fd, SOMAXCONN) != 0) {
+        e = errno;
+        (void) close(fd);
+        errno = e;
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * POST an event message to the store URL it carries
+ */
+static void relay_forward(curl_ez_t *ez, const char *buf, size_t size)
+{
+    relay_hdr_t hdr;
+    char *url = NULL;
+    char *auth = NULL;
+    const char *body;
+    curl_ez_reply rep;
+
+    if (size < sizeof(hdr)) goto out_malformed;
+    (void) memcpy(&hdr, buf, sizeof(hdr));
+    if (hdr.magic != RELAY_MAGIC ||
+            sizeof(hdr) + (uint64_t) hdr.url_len + hdr.auth_len + hdr.body_len != size) {
+        goto out_malformed;
+    }
+
+    url = strndup(buf + sizeof(hdr), hdr.url_len);
+    auth = strndup(buf + sizeof(hdr) + hdr.url_len, hdr.auth_len);
+    body = buf + sizeof(hdr) + hdr.url_len + hdr.auth_len;
+    if (url == NULL || auth == NULL) {
+        LOG_ERR("strndup() fail  ENOMEM?!");
+        goto out_free;
+    }
+
+    /* Only the auth header is taken from clients, never arbitrary ones */
+    if (!strprefix(auth, RELAY_AUTH_PREFIX) || strpbrk(auth, "\r\n") != NULL ||
+            strlen(auth) != hdr.auth_len) {
+        LOG_WARN("Malformed auth header line, dropped");
+        goto out_free;
+    }
+
+    curl_ez_clear_headers(ez);
+    if (curl_ez_set_header(ez, auth) != CURLE_OK ||
+            curl_ez_set_header(ez, "Content-Type: application/json") != CURLE_OK) {
+        LOG_ERR("curl_ez_set_header() fail");
+        goto out_free;
+    }
+
+    rep = curl_ez_post(ez, url, body, hdr.body_len, CURL_EZ_FLAG_DISCARD_REPLY);
+    if (rep.status_code != 200) {
+        LOG_ERR("POST fail  url: %s status code: %d data: %s", url, rep.status_code, rep.data);
+    }
+
+out_free:
+    free(url);
+    free(auth);
+    return;
+
+out_malformed:
+    LOG_WARN("Malformed message  size: %zu", size);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct pollfd pfds[RELAY_MAX_CLIENTS + 1];
+    static char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    struct sigaction sa;
+    curl_ez_t *ez;
+    char *buf;
+    nfds_t i, n = 1;
+    ssize_t sz;
+    int fd;
+
+    if (argc > 2) {
+        LOG_ERR("usage: %s [SOCKET_PATH]", argv[0]);
+        return 1;
+    }
+
+    if (argc > 1) {
+        (void) snprintf(path, sizeof(path), "%s", argv[1]);
+    } else if (relay_default_path(path, sizeof(path)) != 0) {
+        LOG_ERR("Cannot resolve default socket path  errno: %d", errno);
+        return 1;
+    }
+
+    /* No SA_RESTART, poll(2) should return upon termination */
+    (void) memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = relay_on_signal;
+    (void) sigemptyset(&sa.sa_mask);
+    (void) sigaction(SIGINT, &sa, NULL);
+    (void) sigaction(SIGTERM, &sa, NULL);
+    (void) signal(SIGPIPE, SIG_IGN);
+
+    buf = (char *) malloc(RELAY_MSG_MAX + 1);
+    ez = curl_ez_new();
+    if (buf == NULL || ez == NULL) {
+        LOG_ERR("Cannot allocate relay buffers  ENOMEM?!");
+        return 1;
+    }
+
+    pfds[0].fd = relay_listen(path);
+    pfds[0].events = POLLIN;
+    if (pfds[0].fd < 0) {
+        LOG_ERR("Cannot listen on %s  errno: %d", path, errno);
+        return 1;
+    }
+
+    while (!relay_stop) {
+        if (poll(pfds, n, -1) < 0) {
+            if (errno == EINTR) continue;
+            LOG_ERR("poll() fail  errno: %d", errno);
+            break;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            fd = accept(pfds[0].fd, NULL, NULL);
+            if (fd >= 0 && !relay_peer_trusted(fd)) {
+                LOG_WARN("Client of another user, connection refused");
+                (void) close(fd);
+            } else if (fd >= 0 && n <= RELAY_MAX_CLIENTS) {
+                pfds[n].fd = fd;
+                pfds[n].events = POLLIN;
+                pfds[n].revents = 0;
+                n++;
+            } else if (fd >= 0) {
+                LOG_WARN("Too many clients, connection refused");
+                (void) close(fd);
+            }
+        }
+
+        for (i = 1; i < n; i++) {
+            if (pfds[i].revents == 0) continue;
+
+            sz = recv(pfds[i].fd, buf, RELAY_MSG_MAX + 1, MSG_DONTWAIT);
+            if (sz > RELAY_MSG_MAX) {
+                LOG_WARN("Message too large, dropped");
+            } else if (sz > 0) {
+                relay_forward(ez, buf, (size_t) sz);
+            } else if (sz == 0 || (errno != EINTR && errno != EAGAIN)) {
+                /* Client gone, fill the hole with the last one */
+                (void) close(pfds[i].fd);
+                pfds[i--] = pfds[--n];
+            }
+        }
+    }
+
+    for (i = 1; i < n; i++) (void) close(pfds[i].fd);
+    (void) close(pfds[0].fd);
+    (void) unlink(path);
+
+    curl_ez_free(ez);
+    free(buf);
+    return 0;
+}